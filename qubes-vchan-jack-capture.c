@@ -0,0 +1,249 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "qubes-vchan-jack.h"
+#include "qubes-vchan-jack-capture.h"
+
+#define CAPTURE_FLUSH_US 20000
+
+/*
+ * Records are appended to an anonymous buffer from whichever thread
+ * produces them, the RT thread included: a slot is reserved with an
+ * atomic add, filled with memcpy and published by writing its type last.
+ * The buffer is written to and locked up front, so the RT path takes no
+ * syscalls or page faults.  A writer thread copies published records to
+ * the file as they come, so the file never needs to fault in memory the
+ * RT thread writes to.
+ */
+struct capture {
+	int fd;
+	uint8_t *map;
+	size_t size;
+	size_t offset;
+	size_t flushed;			// written to the file so far
+	uint64_t dropped;
+	volatile bool running;
+	pthread_t thread;
+};
+
+bool qubes_jack_capture_active;
+static struct capture cap = { .fd = -1 };
+
+static int write_all(int fd, const uint8_t *buf, size_t len, off_t pos)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+	return 0;
+}
+
+// Write out the records published since the last drain, stopping at the
+// first one still being filled
+static void capture_drain(void)
+{
+	struct qubes_jack_capture_record *rec;
+	size_t used = __atomic_load_n(&cap.offset, __ATOMIC_ACQUIRE);
+	size_t end = cap.flushed;
+
+	if (used > cap.size)
+		used = cap.size;
+	while (end + sizeof(*rec) <= used) {
+		rec = (struct qubes_jack_capture_record *)(cap.map + end);
+		if (!__atomic_load_n(&rec->type, __ATOMIC_ACQUIRE))
+			break;
+		end += sizeof(*rec) + ((rec->len + 7) & ~7);
+	}
+	if (end == cap.flushed)
+		return;
+
+	if (write_all(cap.fd, cap.map + cap.flushed, end - cap.flushed,
+		      cap.flushed))
+		fprintf(stderr, "capture: write failed: %s\n", strerror(errno));
+	cap.flushed = end;
+}
+
+static void *capture_writer(void *arg)
+{
+	(void)arg;
+	while (cap.running) {
+		capture_drain();
+		usleep(CAPTURE_FLUSH_US);
+	}
+	return NULL;
+}
+
+int qubes_jack_capture_open(const char *path, size_t size_mb)
+{
+	struct qubes_jack_capture_header *hdr;
+
+	cap.size = size_mb * 1024 * 1024;
+	if (cap.size < sizeof(*hdr))
+		return -1;
+
+	cap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cap.fd < 0) {
+		fprintf(stderr, "capture: can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	cap.map = mmap(NULL, cap.size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (cap.map == MAP_FAILED) {
+		fprintf(stderr, "capture: can't allocate %zu MiB: %s\n", size_mb,
+			strerror(errno));
+		close(cap.fd);
+		cap.fd = -1;
+		cap.map = NULL;
+		return -1;
+	}
+	// Touch every page now, and keep them: best effort, RLIMIT_MEMLOCK
+	// may not allow it
+	memset(cap.map, 0, cap.size);
+	mlock(cap.map, cap.size);
+
+	hdr = (struct qubes_jack_capture_header *)cap.map;
+	memcpy(hdr->magic, QUBES_JACK_CAPTURE_MAGIC, sizeof(hdr->magic));
+	cap.offset = sizeof(*hdr);
+	cap.flushed = 0;
+	cap.dropped = 0;
+
+	// The header goes out first, its size stays 0 until the close
+	if (write_all(cap.fd, cap.map, sizeof(*hdr), 0)) {
+		fprintf(stderr, "capture: can't write %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	cap.flushed = sizeof(*hdr);
+
+	cap.running = true;
+	if (pthread_create(&cap.thread, NULL, capture_writer, NULL)) {
+		fprintf(stderr, "capture: can't start writer\n");
+		goto fail;
+	}
+
+	__atomic_store_n(&qubes_jack_capture_active, true, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	munlock(cap.map, cap.size);
+	munmap(cap.map, cap.size);
+	close(cap.fd);
+	cap.map = NULL;
+	cap.fd = -1;
+	return -1;
+}
+
+void qubes_jack_capture_close(void)
+{
+	struct qubes_jack_capture_header *hdr;
+
+	if (!cap.map)
+		return;
+
+	__atomic_store_n(&qubes_jack_capture_active, false, __ATOMIC_RELEASE);
+	cap.running = false;
+	pthread_join(cap.thread, NULL);
+	capture_drain();
+
+	hdr = (struct qubes_jack_capture_header *)cap.map;
+	hdr->size = cap.flushed;
+	hdr->dropped = cap.dropped;
+	if (write_all(cap.fd, cap.map, sizeof(*hdr), 0) || fsync(cap.fd))
+		fprintf(stderr, "capture: can't finish file: %s\n", strerror(errno));
+
+	munlock(cap.map, cap.size);
+	munmap(cap.map, cap.size);
+	close(cap.fd);
+
+	if (cap.dropped)
+		fprintf(stderr, "capture: full, %llu records dropped\n",
+			(unsigned long long)cap.dropped);
+
+	cap.map = NULL;
+	cap.fd = -1;
+}
+
+void qubes_jack_capture(uint16_t type, uint16_t stream, const void *data,
+			uint32_t len)
+{
+	struct qubes_jack_capture_record *rec;
+	size_t total = sizeof(*rec) + ((len + 7) & ~7);
+	size_t offset;
+
+	if (!__atomic_load_n(&qubes_jack_capture_active, __ATOMIC_ACQUIRE))
+		return;
+
+	offset = __atomic_fetch_add(&cap.offset, total, __ATOMIC_ACQ_REL);
+	if (offset + total > cap.size) {
+		__atomic_add_fetch(&cap.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = (struct qubes_jack_capture_record *)(cap.map + offset);
+	rec->stream = stream;
+	rec->len = len;
+	rec->ts_ns = now_ns();
+	memcpy(rec + 1, data, len);
+	__atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+}
+
+void qubes_jack_capture_info(uint32_t role, uint32_t sample_rate,
+			     uint32_t batch, uint32_t rec_batch)
+{
+	struct qubes_jack_capture_info info;
+
+	info.role = role;
+	info.sample_rate = sample_rate;
+	info.batch = batch;
+	info.rec_batch = rec_batch;
+	qubes_jack_capture(QUBES_JACK_CAP_INFO, 0, &info, sizeof(info));
+}
+
+void qubes_jack_capture_period(uint16_t stream, uint32_t nframes,
+			       uint32_t channels, bool receiving, int32_t ready)
+{
+	struct qubes_jack_capture_period p;
+
+	p.nframes = nframes;
+	p.channels = channels;
+	p.receiving = receiving;
+	p.ready = ready;
+	qubes_jack_capture(QUBES_JACK_CAP_PERIOD, stream, &p, sizeof(p));
+}
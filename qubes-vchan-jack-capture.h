@@ -0,0 +1,100 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef QUBES_VCHAN_JACK_CAPTURE_H
+#define QUBES_VCHAN_JACK_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capture file layout, native byte order:
+ *
+ * struct qubes_jack_capture_header, then records back to back, each a
+ * struct qubes_jack_capture_record followed by len bytes of payload padded
+ * to 8 bytes.  A record whose type is still 0 was never completed and ends
+ * the capture.
+ */
+#define QUBES_JACK_CAPTURE_MAGIC "QJCAP001"
+#define QUBES_JACK_CAPTURE_DEFAULT_MB 64
+
+// payload: struct qubes_jack_capture_info, again whenever the batch changes
+#define QUBES_JACK_CAP_INFO 1
+// payload: struct qubes_jack_capture_period
+#define QUBES_JACK_CAP_PERIOD 2
+// payload: bytes written to the vchan
+#define QUBES_JACK_CAP_SEND 3
+// payload: bytes read from the vchan
+#define QUBES_JACK_CAP_RECV 4
+// payload: bytes read from the vchan and thrown away (drop-oldest)
+#define QUBES_JACK_CAP_DISCARD 5
+// payload: raw control bytes written / read
+#define QUBES_JACK_CAP_CTRL_TX 6
+#define QUBES_JACK_CAP_CTRL_RX 7
+
+#define QUBES_JACK_CAP_STREAM_PLAY 0
+#define QUBES_JACK_CAP_STREAM_REC 1
+#define QUBES_JACK_CAP_STREAM_CTRL 2
+
+#define QUBES_JACK_CAP_ROLE_SERVER 0
+#define QUBES_JACK_CAP_ROLE_CLIENT 1
+
+struct qubes_jack_capture_header {
+	char magic[8];
+	uint64_t size;			// bytes used, header included
+	uint64_t dropped;		// records that didn't fit
+};
+
+struct qubes_jack_capture_record {
+	uint16_t type;
+	uint16_t stream;
+	uint32_t len;
+	uint64_t ts_ns;
+};
+
+struct qubes_jack_capture_info {
+	uint32_t role;
+	uint32_t sample_rate;
+	uint32_t batch;
+	uint32_t rec_batch;		// 0: same as batch
+};
+
+struct qubes_jack_capture_period {
+	uint32_t nframes;
+	uint32_t channels;
+	uint32_t receiving;		// 1: the stream reads from the vchan
+	int32_t ready;			// bytes queued (recv) or free (send), -1: not looked
+};
+
+extern bool qubes_jack_capture_active;
+
+int qubes_jack_capture_open(const char *path, size_t size_mb);
+void qubes_jack_capture_close(void);
+void qubes_jack_capture(uint16_t type, uint16_t stream, const void *data,
+			uint32_t len);
+void qubes_jack_capture_info(uint32_t role, uint32_t sample_rate,
+			     uint32_t batch, uint32_t rec_batch);
+void qubes_jack_capture_period(uint16_t stream, uint32_t nframes,
+			       uint32_t channels, bool receiving, int32_t ready);
+
+#endif
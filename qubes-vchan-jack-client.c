@@ -34,13 +34,21 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h> // ceilf()
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "qubes-vchan-jack.h"
-#include <libvchan.h>
+#include "qubes-vchan-jack-stream.h"
+#include "qubes-vchan-jack-control.h"
+#include "qubes-vchan-jack-capture.h"
+#include "qubes-vchan-jack-transport.h"
+#include "qubes-vchan-jack-trace.h"
+#include "qubes-vchan-jack-route.h"
 
 #include <jack/jack.h>
 #include <jack/statistics.h>
@@ -56,18 +64,97 @@ struct userdata {
 	jack_port_t *input_ports[MAX_CH];
 	jack_port_t *output_ports[MAX_CH];
 
-	libvchan_t *control;
-	libvchan_t *play;
-	libvchan_t *rec;
+	struct qubes_jack_chan *control;
+	struct qubes_jack_chan *play;
+	struct qubes_jack_chan *rec;
+
+	struct qubes_jack_stream play_stream;
+	struct qubes_jack_stream rec_stream;
+	struct qubes_jack_ctrl ctrl;
 
 	char *tmpbuffer;
+	uint32_t scratch_frames;	// period tmpbuffer is sized for
+	pthread_mutex_t buffers_lock;	// JACK and control threads resize
+	unsigned int server_buffer_size;
 	unsigned int play_count;
 	unsigned int record_count;
 	bool ports_ready;
 	bool pause;
-	bool skip_process;
+	unsigned int want_dirs;		// QUBES_JACK_DIR_* asked for with -d
+	volatile unsigned int dirs;	// in use on this link
+	bool clocked;
+	volatile bool freewheeling;
+
+	struct qubes_jack_rt_sync rt;
+	int notify;			// NOTIFY_* bits, set from JACK callbacks
+	unsigned int server_xruns;
+	unsigned int xrun_total;
+
+	int domid;
+	volatile bool link_up;		// vchans may be touched by the RT thread
+	bool awaiting_audio;
+	uint64_t lost_ns;		// when the server went away
+	volatile uint64_t resume_ns;	// when the RT thread saw it come back
+	unsigned int reconnects;
+	uint64_t last_ttfa_ns;
+
+	// Routes for the server to use, from the -R file
+	const char *route_path;
+	char route_spec[2][QUBES_JACK_ROUTE_SPEC_MAX];
+
+	const struct qubes_jack_transport *transport;
 };
 
+#define NOTIFY_BUFFER_SIZE (1 << 0)
+#define NOTIFY_FREEWHEEL (1 << 1)
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t dump_stats;
+static volatile sig_atomic_t reload_routes;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-d directions] [-p policy] [-r policy] [-l frames] [-t transport] [-R file] [-w file [-W MiB]] [-T file] <domid>\n", prog);
+	fprintf(stderr, "  -c  clock JACK cycles from SoundVM period arrivals\n");
+	fprintf(stderr, "  -d  directions: duplex (default), play or record\n");
+	fprintf(stderr, "  -p  playback overflow policy\n");
+	fprintf(stderr, "  -r  record underflow policy\n");
+	fprintf(stderr, "      drop-newest (default), drop-oldest or block[:timeout_ms]\n");
+	fprintf(stderr, "  -l  frames queued beyond a period before latency is trimmed\n");
+	fprintf(stderr, "  -t  transport: vchan (default) or memfd for same-host peers\n");
+	fprintf(stderr, "  -R  routes for the server, \"play <route>\" and \"record <route>\"\n");
+	fprintf(stderr, "      lines, read again on SIGHUP\n");
+	fprintf(stderr, "  -w  capture streams and control traffic to a file\n");
+	fprintf(stderr, "  -W  capture file size in MiB (default %d)\n",
+		QUBES_JACK_CAPTURE_DEFAULT_MB);
+	fprintf(stderr, "  -T  write a Chrome/Perfetto trace of every cycle to a file\n");
+}
+
+static void handle_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		dump_stats = 1;
+	else if (sig == SIGHUP)
+		reload_routes = 1;
+	else
+		quit = 1;
+}
+
+static void print_stats(struct userdata *u)
+{
+	fprintf(stderr, "xruns: %u, reconnects: %u, last time to first audio: %"
+		PRIu64 " us\n", u->xrun_total, u->reconnects,
+		u->last_ttfa_ns / 1000);
+	fprintf(stderr, "period: %u frames, server %u frames\n",
+		u->jack_buffer_size, u->server_buffer_size);
+	fprintf(stderr, "directions: %s, server set up %s\n",
+		qubes_jack_dirs_name(u->want_dirs),
+		qubes_jack_dirs_name(u->dirs));
+	qubes_jack_stream_print_stats(&u->play_stream, stderr);
+	qubes_jack_stream_print_stats(&u->rec_stream, stderr);
+	qubes_jack_ctrl_print(&u->ctrl, stderr);
+}
+
 static void close_jack_ports(struct userdata *u)
 {
 	unsigned int c;
@@ -118,6 +205,8 @@ static int qubes_jack_xrun_callback(void *arg)
 	int fragments = (int)ceilf( ((delay / 1000000.0) * u->jack_sample_rate )
 				   / (float)(u->jack_buffer_size) );
 	u->jack_xruns += fragments;
+	u->xrun_total += fragments;
+	qubes_jack_trace_instant("xrun", NULL, fragments);
 	return 0;
 }
 
@@ -149,75 +238,551 @@ static int qubes_jack_graph_order_callback(void *arg)
 	return 0;
 }
 
+/*
+ * Size the scratch and staging buffers for periods of frames frames.  A
+ * stream that can't be resized keeps its old size and drops longer
+ * periods, so tmpbuffer is kept at least as big as either stream's.
+ */
+static int resize_buffers(struct userdata *u, uint32_t frames)
+{
+	char *buf;
+	int ret;
+
+	if (frames == u->scratch_frames)
+		return 0;
+
+	buf = frames <= MAX_JACK_BUFFER ?
+		malloc(QUBES_JACK_SCRATCH_BYTES(frames)) : NULL;
+	if (!buf) {
+		fprintf(stderr, "Can't resize buffers for %u frame periods\n",
+			frames);
+		return -1;
+	}
+
+	pthread_mutex_lock(&u->buffers_lock);
+	ret = qubes_jack_stream_set_period(&u->play_stream, frames);
+	ret |= qubes_jack_stream_set_period(&u->rec_stream, frames);
+	pthread_mutex_unlock(&u->buffers_lock);
+	if (ret)
+		fprintf(stderr, "Can't resize buffers for %u frame periods\n",
+			frames);
+
+	if (ret && frames < u->scratch_frames) {
+		free(buf);
+	} else {
+		free(u->tmpbuffer);
+		u->tmpbuffer = buf;
+		u->scratch_frames = frames;
+	}
+	return ret;
+}
+
+/*
+ * JACK calls this from its notification thread with the graph stopped,
+ * before the first cycle of the new size, so the buffers can be swapped
+ * here without waiting the process callback out.  The control thread
+ * then tells the server, which relinks if the rings are now too small.
+ */
+static int qubes_jack_buffer_size_callback(jack_nframes_t nframes, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	resize_buffers(u, nframes);
+	u->jack_buffer_size = nframes;
+	__atomic_or_fetch(&u->notify, NOTIFY_BUFFER_SIZE, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/*
+ * While jackd freewheels nobody is listening in realtime, so trade the
+ * realtime drop behaviour for blocking backpressure: every period is
+ * delivered and the render runs as fast as the SoundVM drains it.  The
+ * server is told too, so that it stops trimming the backlog we build up.
+ */
+static void qubes_jack_freewheel_callback(int starting, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	u->freewheeling = starting ? true : false;
+	u->play_stream.lossless = u->freewheeling;
+	u->rec_stream.lossless = u->freewheeling;
+	__atomic_or_fetch(&u->notify, NOTIFY_FREEWHEEL, __ATOMIC_SEQ_CST);
+}
+
 static void reconfigure_jack_client(struct userdata *u, int play, int rec)
 {
+	uint64_t t = qubes_jack_trace_begin();
+
+	// Keep the process callback off the port arrays while they change
 	u->ports_ready = false;
+	qubes_jack_rt_sync(&u->rt);
 
 	close_jack_ports(u);
 
+	// Whatever is queued or staged is in the old width
+	if (play != (int)u->play_count)
+		qubes_jack_stream_flush(&u->play_stream);
+	if (rec != (int)u->record_count)
+		qubes_jack_stream_flush(&u->rec_stream);
 	u->play_count = play;
 	u->record_count = rec;
 
 	open_jack_ports(u);
 
 	u->ports_ready = true;
-	u->skip_process = true;
+	qubes_jack_trace_end(t, "reconfigure", "ports", play << 8 | rec);
+}
+
+static void apply_server_config(struct userdata *u, uint8_t new_play_count,
+				uint8_t new_record_count,
+				uint32_t new_buffer_size,
+				uint32_t new_sample_rate)
+{
+	// Periods may differ, the rings carry frames rather than periods
+	u->server_buffer_size = new_buffer_size;
+
+	// No ports for a direction we don't use, whatever the server has
+	if (!(u->want_dirs & QUBES_JACK_DIR_PLAY))
+		new_play_count = 0;
+	if (!(u->want_dirs & QUBES_JACK_DIR_REC))
+		new_record_count = 0;
+
+	// Check if jack config changed
+	if ((new_play_count != u->play_count) ||
+			(new_record_count != u->record_count))
+		reconfigure_jack_client(u, new_play_count, new_record_count);
+	// FIXME: Handle jack server changing its sample rate
+	if (new_sample_rate != u->jack_sample_rate)
+		fprintf(stderr, "Warning: SoundVM runs at %u Hz, AppVM at %u Hz\n",
+			new_sample_rate, u->jack_sample_rate);
+}
+
+/*
+ * The server runs this domain in the throughput profile.  Batching our
+ * record side too would defeat clocked mode, which needs every period.
+ */
+static void apply_batch(struct userdata *u, uint32_t batch)
+{
+	uint32_t rec_batch = u->clocked ? 1 : batch;
+
+	if (batch == u->play_stream.batch && rec_batch == u->rec_stream.batch)
+		return;
+
+	// Keep the process callback off the streams while they change
+	u->ports_ready = false;
+	qubes_jack_rt_sync(&u->rt);
+
+	pthread_mutex_lock(&u->buffers_lock);
+	if (qubes_jack_stream_set_batch(&u->play_stream, batch) ||
+	    qubes_jack_stream_set_batch(&u->rec_stream, rec_batch))
+		fprintf(stderr, "Can't batch %u periods per transfer\n", batch);
+	pthread_mutex_unlock(&u->buffers_lock);
+	qubes_jack_capture_info(QUBES_JACK_CAP_ROLE_CLIENT, u->jack_sample_rate,
+				u->play_stream.batch, u->rec_stream.batch);
+
+	u->ports_ready = true;
+}
+
+/*
+ * The server has set up dirs for us: keep the process callback off the
+ * other vchan and close it.  A server that predates directions sets up
+ * both, and then both stay open.
+ */
+static void set_directions(struct userdata *u, unsigned int dirs)
+{
+	if (!u->play)
+		dirs &= ~QUBES_JACK_DIR_PLAY;
+	if (!u->rec)
+		dirs &= ~QUBES_JACK_DIR_REC;
+
+	if (dirs != u->dirs) {
+		u->dirs = dirs;
+		qubes_jack_rt_sync(&u->rt);
+	}
+
+	if (!(dirs & QUBES_JACK_DIR_PLAY) && u->play) {
+		qubes_jack_chan_close(u->play);
+		u->play = NULL;
+	}
+	if (!(dirs & QUBES_JACK_DIR_REC) && u->rec) {
+		qubes_jack_chan_close(u->rec);
+		u->rec = NULL;
+	}
+}
+
+/*
+ * Read "play <route>" and "record <route>" lines from the -R file, skipping
+ * blank lines and # comments.  A direction without a line goes back to
+ * identity.  Nothing changes unless every line parses.
+ */
+static int load_routes(struct userdata *u)
+{
+	char spec[2][QUBES_JACK_ROUTE_SPEC_MAX] = { "", "" };
+	char line[QUBES_JACK_ROUTE_SPEC_MAX + 16];
+	struct qubes_jack_route check;
+	char *name, *arg, *end;
+	unsigned int dir, n = 0;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(u->route_path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", u->route_path,
+			strerror(errno));
+		return -1;
+	}
+	while (!ret && fgets(line, sizeof(line), f)) {
+		n++;
+		name = line + strspn(line, " \t");
+		end = name + strlen(name);
+		while (end > name && strchr(" \t\r\n", end[-1]))
+			*--end = '\0';
+		if (!*name || *name == '#')
+			continue;
+
+		arg = name + strcspn(name, " \t");
+		if (*arg)
+			*arg++ = '\0';
+		arg += strspn(arg, " \t");
+		if (!strcmp(name, "play")) {
+			dir = QUBES_JACK_ROUTE_PLAY;
+		} else if (!strcmp(name, "record")) {
+			dir = QUBES_JACK_ROUTE_REC;
+		} else {
+			fprintf(stderr, "%s:%u: expected play or record\n",
+				u->route_path, n);
+			ret = -1;
+			break;
+		}
+		if (strlen(arg) >= QUBES_JACK_ROUTE_SPEC_MAX ||
+		    qubes_jack_route_build(&check, arg, MAX_CH,
+					   dir == QUBES_JACK_ROUTE_PLAY)) {
+			fprintf(stderr, "%s:%u: bad route: %s\n",
+				u->route_path, n, arg);
+			ret = -1;
+			break;
+		}
+		strcpy(spec[dir], arg);
+	}
+	fclose(f);
+
+	if (!ret)
+		memcpy(u->route_spec, spec, sizeof(spec));
+	return ret;
+}
+
+static void send_routes(struct userdata *u)
+{
+	unsigned int dir;
+
+	if (!u->route_path)
+		return;
+	for (dir = 0; dir < 2; dir++)
+		qubes_jack_ctrl_send_route(&u->ctrl, dir, u->route_spec[dir]);
 }
 
 static void process_vchan_server_response(struct userdata *u)
 {
-	uint8_t buf[QUBES_JACK_CONFIG_QUERY_SIZE];
-	uint8_t new_play_count = u->play_count;
-	uint8_t new_record_count = u->record_count;
-	uint32_t new_buffer_size = u->jack_buffer_size;
-	uint32_t new_sample_rate = u->jack_sample_rate;
-	uint32_t new_xrun_count = u->jack_xruns;
-
-        if (libvchan_data_ready(u->control) >= QUBES_JACK_CONFIG_QUERY_SIZE) {
-                // Read config packet if it's waiting
-                libvchan_read(u->control, buf, QUBES_JACK_CONFIG_QUERY_SIZE);
-
-                // Parse config packet
-                if ((buf[0] == QUBES_JACK_CONFIG_QUERY_START) &&
-                                buf[12] == QUBES_JACK_CONFIG_QUERY_END) {
-                        new_play_count = buf[1];
-                        new_record_count = buf[2];
-                        new_buffer_size = (uint32_t)(1 << buf[3]);
-                        new_sample_rate = read_nth_u32(buf, 1);
-			new_xrun_count = read_nth_u32(buf, 2); 
+	struct qubes_jack_msg msg;
+	uint8_t *buf = msg.val;
+
+	while (qubes_jack_ctrl_recv(&u->ctrl, &msg)) {
+		if (qubes_jack_ctrl_handle_common(&u->ctrl, &msg))
+			continue;
+
+		switch (msg.type) {
+		case QUBES_JACK_MSG_V1_CONFIG:
+			// Parse config packet
+			if (buf[12] != QUBES_JACK_CONFIG_QUERY_END ||
+			    u->ctrl.version >= 2)
+				break;
+			u->ctrl.version = 1;
+			u->server_xruns = read_nth_u32(buf, 2);
+			apply_server_config(u, buf[1], buf[2],
+					    (uint32_t)(1 << buf[3]),
+					    read_nth_u32(buf, 1));
+			break;
+		case QUBES_JACK_TLV_HELLO:
+			u->ctrl.version = QUBES_JACK_CONTROL_VERSION;
+			set_directions(u, qubes_jack_hello_dirs(&msg));
+			// The server sizes the rings for our period too
+			qubes_jack_ctrl_send_u32(&u->ctrl,
+						 QUBES_JACK_TLV_BUFFER_SIZE,
+						 u->jack_buffer_size);
+			// Record periods have to keep coming one at a time
+			if (u->clocked)
+				qubes_jack_ctrl_send_u32(&u->ctrl,
+							 QUBES_JACK_TLV_CLOCKED,
+							 1);
+			// A server that came back mid-render starts out realtime
+			if (u->freewheeling)
+				qubes_jack_ctrl_send_u32(&u->ctrl,
+							 QUBES_JACK_TLV_FREEWHEEL,
+							 1);
+			send_routes(u);
+			break;
+		case QUBES_JACK_TLV_CONFIG:
+			if (msg.len < 3 * sizeof(uint32_t))
+				break;
+			u->server_xruns = read_nth_u32(buf, 2);
+			apply_server_config(u, buf[0], buf[1],
+					    (uint32_t)(1 << buf[2]),
+					    read_nth_u32(buf, 1));
+			break;
+		case QUBES_JACK_TLV_PORTS:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			apply_server_config(u, buf[0], buf[1],
+					    u->server_buffer_size,
+					    u->jack_sample_rate);
+			// The server holds what changed until we echo them
+			qubes_jack_ctrl_send(&u->ctrl, QUBES_JACK_TLV_PORTS, buf,
+					     sizeof(uint32_t));
+			break;
+		case QUBES_JACK_TLV_BUFFER_SIZE:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			u->server_buffer_size = read_nth_u32(buf, 0);
+			break;
+		case QUBES_JACK_TLV_BATCH:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			apply_batch(u, read_nth_u32(buf, 0));
+			break;
+		case QUBES_JACK_TLV_SAMPLE_RATE:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			apply_server_config(u, u->play_count, u->record_count,
+					    u->server_buffer_size,
+					    read_nth_u32(buf, 0));
+			break;
+		default:
+			// Unknown messages are skipped for forward compatibility
+			break;
 		}
+	}
+}
+
+static int vchan_conn(struct userdata *u, int domid, bool verbose)
+{
+	u->play = qubes_jack_chan_client_init(u->transport, domid,
+			QUBES_JACK_PLAYBACK_VCHAN_PORT);
+	if (!u->play) {
+		if (verbose)
+			fprintf(stderr, "%s client init play failed\n",
+				u->transport->name);
+		return -1;
+	}
+	qubes_jack_stream_reset(&u->play_stream, u->play);
+	u->rec = qubes_jack_chan_client_init(u->transport, domid,
+			QUBES_JACK_RECORD_VCHAN_PORT);
+	if (!u->rec) {
+		if (verbose)
+			fprintf(stderr, "%s client init rec failed\n",
+				u->transport->name);
+		return -1;
+	}
+	qubes_jack_stream_reset(&u->rec_stream, u->rec);
+	u->control = qubes_jack_chan_client_init(u->transport, domid,
+			QUBES_JACK_CONFIG_VCHAN_PORT);
+	if (!u->control) {
+		if (verbose)
+			fprintf(stderr, "%s client init control failed\n",
+				u->transport->name);
+		return -1;
+	}
+	qubes_jack_ctrl_init(&u->ctrl, u->control);
+	return 0;
+}
+
+void vchan_done(struct userdata *u)
+{
+	if (u->play)
+		qubes_jack_chan_close(u->play);
+
+	if (u->rec)
+		qubes_jack_chan_close(u->rec);
+
+	if (u->control)
+		qubes_jack_chan_close(u->control);
+
+	u->play = NULL;
+	u->rec = NULL;
+	u->control = NULL;
+}
+
+/*
+ * Open with a v2 HELLO.  If the server hasn't answered within
+ * QUBES_JACK_HELLO_TIMEOUT_MS it only speaks v1, so send the v1 query.
+ * A v2 server that was just slow ignores the query once it has our HELLO,
+ * and its reply still switches us to v2 when it arrives.
+ */
+static void negotiate_protocol(struct userdata *u)
+{
+	uint8_t cmd = QUBES_JACK_CONFIG_QUERY_CMD;
+	uint64_t deadline;
+	struct pollfd pfd;
+
+	qubes_jack_ctrl_send_hello(&u->ctrl, u->want_dirs);
+
+	deadline = now_ns() + QUBES_JACK_HELLO_TIMEOUT_MS * 1000000ULL;
+	pfd.fd = qubes_jack_chan_fd_for_select(u->control);
+	pfd.events = POLLIN;
+	while (!u->ctrl.version && now_ns() < deadline && !quit) {
+		if (poll(&pfd, 1, 10) > 0)
+			qubes_jack_chan_wait(u->control);
+		process_vchan_server_response(u);
+	}
 
-		// Check if jack config changed
-		if ((new_play_count != u->play_count) ||
-				(new_record_count != u->record_count) ||
-				(new_buffer_size != u->jack_buffer_size)) {
-			reconfigure_jack_client(u, new_play_count, new_record_count);
+	// Take a reply that came in with the deadline before giving up on it
+	if (!u->ctrl.version) {
+		if (poll(&pfd, 1, 0) > 0)
+			qubes_jack_chan_wait(u->control);
+		process_vchan_server_response(u);
+	}
+
+	if (!u->ctrl.version && qubes_jack_chan_buffer_space(u->control) >= 1)
+		qubes_jack_chan_write(u->control, &cmd, 1);
+}
+
+static bool server_lost(struct userdata *u)
+{
+	uint64_t stale = 5 * QUBES_JACK_HEARTBEAT_MS * 1000000ULL;
+
+	// A vchan closed for a direction we don't use is fine
+	if (qubes_jack_chan_is_open(u->control) == 0 ||
+			(u->play && qubes_jack_chan_is_open(u->play) == 0) ||
+			(u->rec && qubes_jack_chan_is_open(u->rec) == 0))
+		return true;
+
+	return u->ctrl.version >= 2 &&
+		now_ns() - u->ctrl.last_heartbeat_ns > stale;
+}
+
+/*
+ * Reconnect to a restarted SoundVM server without restarting the AppVM's
+ * JACK client, and report how long the first period took to arrive.
+ */
+static void check_link(struct userdata *u)
+{
+	uint64_t first;
+
+	if (u->link_up && u->awaiting_audio && u->resume_ns) {
+		first = u->rec_stream.first_data_ns;
+		if (!first && !u->record_count)
+			first = u->resume_ns;
+		if (first) {
+			u->awaiting_audio = false;
+			u->last_ttfa_ns = first > u->resume_ns ?
+				first - u->resume_ns : 0;
+			fprintf(stderr, "Server connected after %" PRIu64
+				" ms, time to first audio %" PRIu64 " us\n",
+				(u->resume_ns - u->lost_ns) / 1000000,
+				u->last_ttfa_ns / 1000);
 		}
-		// FIXME: Handle jack server changing its sample rate
-		u->jack_xruns = new_xrun_count;
-		new_sample_rate = new_sample_rate;
 	}
+
+	if (u->link_up) {
+		if (!server_lost(u))
+			return;
+
+		fprintf(stderr, "Server lost, reconnecting\n");
+		u->lost_ns = now_ns();
+		u->link_up = false;
+		qubes_jack_rt_sync(&u->rt);
+		vchan_done(u);
+		// The next server may not ask for a batch at all
+		apply_batch(u, 1);
+	}
+
+	if (vchan_conn(u, u->domid, false)) {
+		vchan_done(u);
+		return;
+	}
+
+	u->reconnects++;
+	u->awaiting_audio = true;
+	u->resume_ns = 0;
+	u->dirs = QUBES_JACK_DIR_DUPLEX;
+	u->link_up = true;
+	negotiate_protocol(u);
 }
 
-static int qubes_jack_process(jack_nframes_t nframes, void *arg)
+static void push_notifications(struct userdata *u)
 {
-	struct userdata *u = (struct userdata *)arg;
+	int notify = __atomic_exchange_n(&u->notify, 0, __ATOMIC_SEQ_CST);
+
+	if (u->ctrl.version < 2)
+		return;
+
+	if (notify & NOTIFY_BUFFER_SIZE)
+		qubes_jack_ctrl_send_u32(&u->ctrl, QUBES_JACK_TLV_BUFFER_SIZE,
+					 u->jack_buffer_size);
+	if (notify & NOTIFY_FREEWHEEL)
+		qubes_jack_ctrl_send_u32(&u->ctrl, QUBES_JACK_TLV_FREEWHEEL,
+					 u->freewheeling);
+}
+
+static void control_loop_iteration(struct userdata *u)
+{
+	struct qubes_jack_stat stats[QUBES_JACK_MAX_STATS];
+	struct pollfd pfd;
+	unsigned int n = 0;
+
+	if (!u->link_up) {
+		// Server not there yet, try again shortly
+		usleep(100000);
+		check_link(u);
+		return;
+	}
+
+	pfd.fd = qubes_jack_chan_fd_for_select(u->control);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 100) > 0)
+		qubes_jack_chan_wait(u->control);
+
+	process_vchan_server_response(u);
+	push_notifications(u);
+	check_link(u);
+
+	// Put our trace on the SoundVM's clock
+	if (u->ctrl.pongs)
+		qubes_jack_trace_clock_offset(u->ctrl.clock_offset_ns);
+
+	stats[n].key = QUBES_JACK_STAT_XRUNS;
+	stats[n++].value = u->xrun_total;
+	stats[n].key = QUBES_JACK_STAT_RECONNECTS;
+	stats[n++].value = u->reconnects;
+	stats[n].key = QUBES_JACK_STAT_TTFA_US;
+	stats[n++].value = u->last_ttfa_ns / 1000;
+	n = qubes_jack_stream_stats(stats, n, QUBES_JACK_STAT_PLAY_BASE,
+				    &u->play_stream);
+	n = qubes_jack_stream_stats(stats, n, QUBES_JACK_STAT_REC_BASE,
+				    &u->rec_stream);
+	qubes_jack_ctrl_tick(&u->ctrl, stats, n);
+}
+
+static void process_cycle(struct userdata *u, jack_nframes_t nframes)
+{
+	uint64_t trace_start = qubes_jack_trace_begin();
 	int t_jack_xruns = u->jack_xruns;
 	int k;
 	unsigned int i;
-	unsigned int c;
-	long f;
-	long j;
 
-        int rec_ready = libvchan_is_open(u->rec);
-        int play_ready = libvchan_is_open(u->play);
+	// Each direction runs as soon as its own vchan is up
+	bool play_on = u->link_up && (u->dirs & QUBES_JACK_DIR_PLAY) &&
+		qubes_jack_chan_is_open(u->play) == 1;
+	bool rec_on = u->link_up && (u->dirs & QUBES_JACK_DIR_REC) &&
+		qubes_jack_chan_is_open(u->rec) == 1;
 
 	//fprintf(stderr, "Process...");
-        if (rec_ready == 1 && play_ready == 1) {
-                u->pause = false;
-        } else if (rec_ready != 1 || play_ready != 1) {
-                u->pause = true;
-        }
+	if (play_on || rec_on) {
+		if (u->pause && !u->resume_ns)
+			u->resume_ns = now_ns();
+		u->pause = false;
+	} else {
+		u->pause = true;
+	}
 	float *bufs_out[u->record_count];
 	float *bufs_in[u->play_count];
 
@@ -227,14 +792,8 @@ static int qubes_jack_process(jack_nframes_t nframes, void *arg)
 	}
 	u->jack_xruns -= t_jack_xruns;
 
-	process_vchan_server_response(u);
-
-	if (u->skip_process) {
-		u->skip_process = false;
-		return 0;
-	}
 	if (!u->ports_ready)
-		return 0;
+		return;
 
 	// get jack output buffers
 	for (i = 0; i < u->play_count; i++)
@@ -246,68 +805,34 @@ static int qubes_jack_process(jack_nframes_t nframes, void *arg)
 
 	if (u->pause) {
 		// paused, play silence on output
-		for (c = 0; c < u->record_count; c++) {
-			float *buffer_out = bufs_out[c];
-			for (f = 0; f < nframes; f++) {
-				buffer_out[f] = 0.f;
-			}
-		}
+		qubes_jack_silence(bufs_out, u->record_count, nframes);
 		// paused, capture silence
-		for (c = 0; c < u->play_count; c++) {
-			float *buffer_in = bufs_in[c];
-			for (f = 0; f < nframes; f++) {
-				buffer_in[f] = 0.f;
-			}
-		}
+		qubes_jack_silence(bufs_in, u->play_count, nframes);
+		qubes_jack_trace_instant("paused silence", NULL, nframes);
 	} else {
 		// unpaused, record audio
-
-		j = u->record_count * nframes * sizeof(float);
-		if (libvchan_data_ready(u->rec) >= j) {
-			//fprintf(stderr, "Rec...");
-			// read a jack sized block from vchan record buffer
-			libvchan_read(u->rec, u->tmpbuffer, j);
-
-			// write jack sized block to jack (rec)
-			for (c = 0; c < u->record_count; c++) {
-				float *buffer_out = bufs_out[c];
-				for (f = 0; f < nframes; f++) {
-					// read interleaved buffer
-					buffer_out[f] = read_nth_float(u->tmpbuffer, c + f * u->record_count);
-				}
-			}
-			//fprintf(stderr, "Rec done...");
-		} else {
-			// capture silence
-			//fprintf(stderr, "Silence...");
-			for (c = 0; c < u->record_count; c++) {
-				float *buffer_out = bufs_out[c];
-				for (f = 0; f < nframes; f++) {
-					// read interleaved buffer
-					buffer_out[f] = 0.f;
-				}
-			}
-		}
+		if (rec_on)
+			qubes_jack_stream_recv(&u->rec_stream, bufs_out,
+					       u->record_count, nframes,
+					       u->tmpbuffer);
+		else
+			qubes_jack_silence(bufs_out, u->record_count, nframes);
 		// unpaused, play audio
-
-		// capture jack sized buffer and write interleaved floats to tmpbuffer
-		for (c = 0; c < u->play_count; c++) {
-			float *buffer_in = bufs_in[c];
-			for (f = 0; f < nframes; f++) {
-				// write interleaved buffer
-				write_nth_float(u->tmpbuffer, c + f * u->play_count, buffer_in[f]);
-			}
-		}
-		// commit tmpbuffer to vchan
-		//fprintf(stderr, "Play0...");
-		j = u->play_count * nframes * sizeof(float);
-		if (libvchan_buffer_space(u->play) >= j) {
-			//fprintf(stderr, "Play1...");
-			libvchan_write(u->play, u->tmpbuffer, j);
-		//} else {
-			//fprintf(stderr, "Silence1...");
-		}
+		if (play_on)
+			qubes_jack_stream_send(&u->play_stream, bufs_in,
+					       u->play_count, nframes,
+					       u->tmpbuffer);
 	}
+	qubes_jack_trace_end(trace_start, "process", NULL, nframes);
+}
+
+static int qubes_jack_process(jack_nframes_t nframes, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	qubes_jack_rt_enter(&u->rt);
+	process_cycle(u, nframes);
+	qubes_jack_rt_leave(&u->rt);
 	return 0;
 }
 
@@ -322,12 +847,6 @@ static void qubes_jack_destroy(struct userdata *u)
 
 static int qubes_jack_init(struct userdata *u)
 {
-	u->tmpbuffer = (char *)malloc(sizeof(float) * MAX_CH * MAX_JACK_BUFFER);
-	if (!u->tmpbuffer) {
-		qubes_jack_destroy(u);
-		return -1;
-	}
-
 	const char *jack_client_name = "qubes-vchan-client";
 	u->jack_client = jack_client_open(jack_client_name, JackNoStartServer, NULL);
 
@@ -336,11 +855,22 @@ static int qubes_jack_init(struct userdata *u)
 		return -1;
 	}
 
+	u->jack_buffer_size = jack_get_buffer_size(u->jack_client);
+	if (resize_buffers(u, u->jack_buffer_size)) {
+		qubes_jack_destroy(u);
+		return -1;
+	}
+
 	u->jack_xruns = 0;
+	u->freewheeling = false;
+	u->play_stream.sample_rate = jack_get_sample_rate(u->jack_client);
+	u->rec_stream.sample_rate = u->play_stream.sample_rate;
 
 	jack_set_process_callback (u->jack_client, qubes_jack_process, u);
 	jack_set_xrun_callback (u->jack_client, qubes_jack_xrun_callback, u);
 	jack_set_graph_order_callback (u->jack_client, qubes_jack_graph_order_callback, u);
+	jack_set_buffer_size_callback (u->jack_client, qubes_jack_buffer_size_callback, u);
+	jack_set_freewheel_callback (u->jack_client, qubes_jack_freewheel_callback, u);
 
 	if (jack_activate (u->jack_client)) {
 		qubes_jack_destroy(u);
@@ -353,52 +883,121 @@ static int qubes_jack_init(struct userdata *u)
 	return 0;
 }
 
-static int vchan_conn(struct userdata *u, int domid)
-{
-	u->play = libvchan_client_init(domid, QUBES_JACK_PLAYBACK_VCHAN_PORT);
-	if (!u->play) {
-		fprintf(stderr, "libvchan_client_init play failed\n");
-		return -1;
-	}
-	u->rec = libvchan_client_init(domid, QUBES_JACK_RECORD_VCHAN_PORT);
-	if (!u->rec) {
-		fprintf(stderr, "libvchan_client_init rec failed\n");
-		return -1;
-	}
-	u->control = libvchan_client_init(domid, QUBES_JACK_CONFIG_VCHAN_PORT);
-	if (!u->control) {
-		fprintf(stderr, "libvchan_client_init control failed\n");
-		return -1;
-	}
-	return 0;
-}
-
-void vchan_done(struct userdata *u)
-{
-	if (u->play)
-		libvchan_close(u->play);
-
-	if (u->rec)
-		libvchan_close(u->rec);
-}
-
 int main(int argc, char **argv)
 {
 	struct userdata u;
-	uint8_t cmd = QUBES_JACK_CONFIG_QUERY_CMD;
+	const char *capture_path = NULL;
+	const char *trace_path = NULL;
+	bool rec_policy = false;
+	size_t capture_mb = QUBES_JACK_CAPTURE_DEFAULT_MB;
+	int opt;
 
+	memset(&u, 0, sizeof(u));
 	u.pause = true;
-	u.skip_process = false;
 	u.ports_ready = false;
+	u.clocked = false;
+	qubes_jack_stream_init(&u.play_stream, "playback");
+	qubes_jack_stream_init(&u.rec_stream, "record");
+	u.play_stream.cancel = &u.rt.cancel;
+	u.rec_stream.cancel = &u.rt.cancel;
+	u.transport = &qubes_jack_transport_vchan;
+	u.want_dirs = QUBES_JACK_DIR_DUPLEX;
+	u.dirs = QUBES_JACK_DIR_DUPLEX;
+	pthread_mutex_init(&u.buffers_lock, NULL);
+
+	while ((opt = getopt(argc, argv, "cd:p:r:l:t:R:w:W:T:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			u.clocked = true;
+			break;
+		case 'd':
+			if (qubes_jack_parse_dirs(optarg) < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			u.want_dirs = qubes_jack_parse_dirs(optarg);
+			break;
+		case 'p':
+			if (qubes_jack_parse_policy(&u.play_stream, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (qubes_jack_parse_policy(&u.rec_stream, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			rec_policy = true;
+			break;
+		case 'l':
+			u.play_stream.max_latency = atoi(optarg);
+			u.rec_stream.max_latency = u.play_stream.max_latency;
+			break;
+		case 't':
+			u.transport = qubes_jack_transport_find(optarg);
+			if (!u.transport) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'R':
+			u.route_path = optarg;
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'W':
+			capture_mb = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-	if (argc < 2) {
+	if (optind >= argc) {
 		fprintf(stderr, "Error: need domid, exiting\n");
+		usage(argv[0]);
+		return 1;
+	}
+	if (u.route_path && load_routes(&u))
+		return 1;
+	if (trace_path && qubes_jack_trace_open(trace_path,
+						QUBES_JACK_TRACE_PID_CLIENT,
+						"AppVM client"))
+		return 1;
+
+	/*
+	 * In clocked mode the AppVM's jackd runs a dummy driver whose cycle
+	 * is shorter than the nominal period, and each cycle blocks until the
+	 * SoundVM has delivered the next period on the record vchan.  The
+	 * SoundVM's hardware clock then drives both graphs, so there is no
+	 * drift between the two sides and no extra period of buffering.
+	 */
+	if (u.clocked && !(u.want_dirs & QUBES_JACK_DIR_REC)) {
+		fprintf(stderr, "Error: -c needs the record direction\n");
 		return 1;
 	}
+	if (u.clocked && rec_policy) {
+		fprintf(stderr, "Error: -c always blocks on record, drop -r\n");
+		return 1;
+	}
+	if (u.clocked) {
+		u.rec_stream.policy = QUBES_JACK_POLICY_BLOCK;
+		u.rec_stream.timeout_ms = 0;
+	}
 
 	fprintf(stderr, "Open Vchan...");
-	if (vchan_conn(&u, atoi(argv[1])))
+	u.domid = atoi(argv[optind]);
+	if (vchan_conn(&u, u.domid, true))
 		return 1;
+	u.link_up = true;
+	u.awaiting_audio = true;
+	u.lost_ns = now_ns();
 	fprintf(stderr, "done\n");
 
 	fprintf(stderr, "Open JACK...");
@@ -406,23 +1005,50 @@ int main(int argc, char **argv)
 		return 1;
 	fprintf(stderr, "done\n");
 
-	fprintf(stderr, "Query for config...");
-	u.record_count = 0;
-	u.play_count = 0;
-	if (libvchan_buffer_space(u.control) >= 1) {
-		libvchan_write(u.control, &cmd, 1);
+	if (capture_path) {
+		if (qubes_jack_capture_open(capture_path, capture_mb))
+			return 1;
+		qubes_jack_capture_info(QUBES_JACK_CAP_ROLE_CLIENT,
+					u.jack_sample_rate, u.play_stream.batch,
+					u.rec_stream.batch);
+		u.play_stream.capture_id = QUBES_JACK_CAP_STREAM_PLAY;
+		u.rec_stream.capture_id = QUBES_JACK_CAP_STREAM_REC;
 	}
-	fprintf(stderr, "done\n");
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGUSR1, handle_signal);
+	signal(SIGHUP, handle_signal);
 
 	fprintf(stderr, "Open JACK ports...");
+	u.record_count = 0;
+	u.play_count = 0;
 	open_jack_ports(&u);
 	fprintf(stderr, "done\n");
 
 	u.ports_ready = true;
 	u.pause = false;
 
-	// Wait until killed
-	sleep(-1);
+	fprintf(stderr, "Query for config...");
+	negotiate_protocol(&u);
+	fprintf(stderr, "done (protocol v%d)\n", u.ctrl.version ? u.ctrl.version : 1);
+
+	/*
+	 * Serve the control channel until killed, SIGUSR1 dumps counters and
+	 * SIGHUP sends the server the routes from the -R file again
+	 */
+	while (!quit) {
+		control_loop_iteration(&u);
+		if (dump_stats) {
+			dump_stats = 0;
+			print_stats(&u);
+		}
+		if (reload_routes) {
+			reload_routes = 0;
+			if (u.route_path && !load_routes(&u))
+				send_routes(&u);
+		}
+	}
 
 	// shutdown
 	u.pause = true;
@@ -431,6 +1057,11 @@ int main(int argc, char **argv)
 	close_jack_ports(&u);
 
 	qubes_jack_destroy(&u);
+	qubes_jack_trace_close();
 	vchan_done(&u);
+	qubes_jack_capture_close();
+	print_stats(&u);
+	qubes_jack_stream_destroy(&u.play_stream);
+	qubes_jack_stream_destroy(&u.rec_stream);
 	return 0;
 }
@@ -0,0 +1,532 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "qubes-vchan-jack-control.h"
+#include "qubes-vchan-jack-capture.h"
+#include "qubes-vchan-jack-route.h"
+
+void qubes_jack_ctrl_init(struct qubes_jack_ctrl *c, struct qubes_jack_chan *ctrl)
+{
+	memset(c, 0, sizeof(*c));
+	c->ctrl = ctrl;
+	c->last_heartbeat_ns = now_ns();
+}
+
+/*
+ * Control traffic is small and infrequent, so a message that doesn't fit
+ * in the ring is dropped rather than waited for.
+ */
+int qubes_jack_ctrl_send(struct qubes_jack_ctrl *c, uint8_t type,
+			 const void *val, uint16_t len)
+{
+	uint8_t buf[QUBES_JACK_TLV_HEADER_SIZE + QUBES_JACK_TLV_MAX_VALUE];
+
+	if (len > QUBES_JACK_TLV_MAX_VALUE)
+		return -1;
+	if (qubes_jack_chan_buffer_space(c->ctrl) < QUBES_JACK_TLV_HEADER_SIZE + len)
+		return -1;
+
+	buf[0] = type;
+	buf[1] = 0;
+	buf[2] = (len >> 8) & 0xff;
+	buf[3] = len & 0xff;
+	memcpy(buf + QUBES_JACK_TLV_HEADER_SIZE, val, len);
+
+	qubes_jack_chan_write(c->ctrl, buf, QUBES_JACK_TLV_HEADER_SIZE + len);
+	qubes_jack_capture(QUBES_JACK_CAP_CTRL_TX, QUBES_JACK_CAP_STREAM_CTRL,
+			   buf, QUBES_JACK_TLV_HEADER_SIZE + len);
+	return 0;
+}
+
+int qubes_jack_ctrl_send_u32(struct qubes_jack_ctrl *c, uint8_t type,
+			     uint32_t value)
+{
+	uint8_t buf[sizeof(uint32_t)];
+
+	write_nth_u32(buf, 0, value);
+	return qubes_jack_ctrl_send(c, type, buf, sizeof(buf));
+}
+
+int qubes_jack_ctrl_send_hello(struct qubes_jack_ctrl *c, unsigned int dirs)
+{
+	uint8_t buf[2 * sizeof(uint32_t)];
+
+	write_nth_u32(buf, 0, QUBES_JACK_CONTROL_VERSION);
+	write_nth_u32(buf, 1, dirs);
+	return qubes_jack_ctrl_send(c, QUBES_JACK_TLV_HELLO, buf, sizeof(buf));
+}
+
+// Directions in a HELLO, duplex if the peer predates them
+unsigned int qubes_jack_hello_dirs(const struct qubes_jack_msg *msg)
+{
+	unsigned int dirs;
+
+	if (msg->len < 2 * sizeof(uint32_t))
+		return QUBES_JACK_DIR_DUPLEX;
+	dirs = read_nth_u32((void *)msg->val, 1) & QUBES_JACK_DIR_DUPLEX;
+	return dirs ? dirs : QUBES_JACK_DIR_DUPLEX;
+}
+
+static const char *dirs_names[] = {
+	[QUBES_JACK_DIR_PLAY] = "play",
+	[QUBES_JACK_DIR_REC] = "record",
+	[QUBES_JACK_DIR_DUPLEX] = "duplex",
+};
+
+int qubes_jack_parse_dirs(const char *arg)
+{
+	unsigned int i;
+
+	for (i = QUBES_JACK_DIR_PLAY; i <= QUBES_JACK_DIR_DUPLEX; i++)
+		if (!strcmp(arg, dirs_names[i]))
+			return i;
+	return -1;
+}
+
+const char *qubes_jack_dirs_name(unsigned int dirs)
+{
+	return dirs_names[dirs & QUBES_JACK_DIR_DUPLEX] ?
+		dirs_names[dirs & QUBES_JACK_DIR_DUPLEX] : "none";
+}
+
+static void ctrl_consume(struct qubes_jack_ctrl *c, unsigned int len)
+{
+	c->rx_len -= len;
+	memmove(c->rx, c->rx + len, c->rx_len);
+}
+
+/*
+ * Pull whatever is waiting on the control vchan and return 1 with the
+ * next complete message in msg, or 0 when there isn't one yet.
+ */
+int qubes_jack_ctrl_recv(struct qubes_jack_ctrl *c, struct qubes_jack_msg *msg)
+{
+	int ready = qubes_jack_chan_data_ready(c->ctrl);
+	unsigned int room = sizeof(c->rx) - c->rx_len;
+	unsigned int len;
+
+	if (ready > 0) {
+		if ((unsigned int)ready > room)
+			ready = room;
+		qubes_jack_chan_read(c->ctrl, c->rx + c->rx_len, ready);
+		qubes_jack_capture(QUBES_JACK_CAP_CTRL_RX,
+				   QUBES_JACK_CAP_STREAM_CTRL,
+				   c->rx + c->rx_len, ready);
+		c->rx_len += ready;
+	}
+
+	if (c->rx_len < 1)
+		return 0;
+
+	// v1 query byte
+	if (c->rx[0] == QUBES_JACK_CONFIG_QUERY_CMD) {
+		msg->type = QUBES_JACK_MSG_V1_QUERY;
+		msg->len = 0;
+		ctrl_consume(c, 1);
+		return 1;
+	}
+
+	// v1 config packet
+	if (c->rx[0] == QUBES_JACK_CONFIG_QUERY_START) {
+		if (c->rx_len < QUBES_JACK_CONFIG_QUERY_SIZE)
+			return 0;
+		msg->type = QUBES_JACK_MSG_V1_CONFIG;
+		msg->len = QUBES_JACK_CONFIG_QUERY_SIZE;
+		memcpy(msg->val, c->rx, QUBES_JACK_CONFIG_QUERY_SIZE);
+		ctrl_consume(c, QUBES_JACK_CONFIG_QUERY_SIZE);
+		return 1;
+	}
+
+	if (c->rx_len < QUBES_JACK_TLV_HEADER_SIZE)
+		return 0;
+
+	len = (c->rx[2] << 8) | c->rx[3];
+	if (len > QUBES_JACK_TLV_MAX_VALUE) {
+		// Garbage, resynchronise on the next read
+		c->rx_len = 0;
+		return 0;
+	}
+	if (c->rx_len < QUBES_JACK_TLV_HEADER_SIZE + len)
+		return 0;
+
+	msg->type = c->rx[0];
+	msg->len = len;
+	memcpy(msg->val, c->rx + QUBES_JACK_TLV_HEADER_SIZE, len);
+	ctrl_consume(c, QUBES_JACK_TLV_HEADER_SIZE + len);
+	return 1;
+}
+
+static void handle_ping(struct qubes_jack_ctrl *c, const struct qubes_jack_msg *msg)
+{
+	uint8_t buf[5 * sizeof(uint32_t)];
+
+	if (msg->len < 3 * sizeof(uint32_t))
+		return;
+
+	memcpy(buf, msg->val, 3 * sizeof(uint32_t));
+	write_nth_u64(buf, 3, now_ns());
+	qubes_jack_ctrl_send(c, QUBES_JACK_TLV_PONG, buf, sizeof(buf));
+}
+
+static void handle_pong(struct qubes_jack_ctrl *c, const struct qubes_jack_msg *msg)
+{
+	uint8_t *val = (uint8_t *)msg->val;
+	uint64_t now = now_ns();
+	uint64_t sent, peer, rtt;
+
+	if (msg->len < 5 * sizeof(uint32_t))
+		return;
+
+	sent = read_nth_u64(val, 1);
+	peer = read_nth_u64(val, 3);
+	if (sent > now)
+		return;
+
+	rtt = now - sent;
+	c->rtt_last_ns = rtt;
+	if (!c->pongs || rtt < c->rtt_min_ns) {
+		c->rtt_min_ns = rtt;
+		// The lowest RTT sample gives the best clock offset estimate
+		c->clock_offset_ns = (int64_t)(peer - (sent + rtt / 2));
+	}
+	if (rtt > c->rtt_max_ns)
+		c->rtt_max_ns = rtt;
+	c->rtt_avg_ns = c->pongs ? (c->rtt_avg_ns * 7 + rtt) / 8 : rtt;
+	c->pongs++;
+}
+
+static void handle_stats(struct qubes_jack_ctrl *c, const struct qubes_jack_msg *msg)
+{
+	uint8_t *val = (uint8_t *)msg->val;
+	unsigned int i, n = msg->len / (3 * sizeof(uint32_t));
+
+	if (n > QUBES_JACK_MAX_STATS)
+		n = QUBES_JACK_MAX_STATS;
+
+	for (i = 0; i < n; i++) {
+		c->peer_stats[i].key = read_nth_u32(val, 3 * i);
+		c->peer_stats[i].value = read_nth_u64(val, 3 * i + 1);
+	}
+	c->peer_stats_count = n;
+}
+
+static void handle_meter(struct qubes_jack_ctrl *c, const struct qubes_jack_msg *msg)
+{
+	uint8_t *val = (uint8_t *)msg->val;
+	struct qubes_jack_meter_values *v;
+	unsigned int ch, i;
+
+	if (msg->len < sizeof(uint32_t) || val[0] > QUBES_JACK_METER_REC)
+		return;
+	ch = val[1];
+	if (ch > MAX_CH || msg->len < (1 + 2 * ch) * sizeof(uint32_t))
+		return;
+
+	v = &c->peer_meter[val[0]];
+	for (i = 0; i < ch; i++) {
+		v->peak[i] = read_nth_float(val, 1 + 2 * i);
+		v->rms[i] = read_nth_float(val, 2 + 2 * i);
+	}
+	v->channels = ch;
+}
+
+/*
+ * Handle the messages both sides treat the same way.  Returns false if the
+ * caller has to deal with msg itself.
+ */
+bool qubes_jack_ctrl_handle_common(struct qubes_jack_ctrl *c,
+				   const struct qubes_jack_msg *msg)
+{
+	switch (msg->type) {
+	case QUBES_JACK_TLV_HEARTBEAT:
+		c->last_heartbeat_ns = now_ns();
+		return true;
+	case QUBES_JACK_TLV_PING:
+		handle_ping(c, msg);
+		return true;
+	case QUBES_JACK_TLV_PONG:
+		handle_pong(c, msg);
+		return true;
+	case QUBES_JACK_TLV_STATS:
+		handle_stats(c, msg);
+		return true;
+	case QUBES_JACK_TLV_METER:
+		handle_meter(c, msg);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Ask the server to route a direction through spec instead
+int qubes_jack_ctrl_send_route(struct qubes_jack_ctrl *c, uint8_t direction,
+			       const char *spec)
+{
+	uint8_t buf[sizeof(uint32_t) + QUBES_JACK_ROUTE_SPEC_MAX];
+	size_t len = strlen(spec);
+
+	if (c->version < 2 || len >= QUBES_JACK_ROUTE_SPEC_MAX)
+		return -1;
+
+	buf[0] = direction;
+	buf[1] = 0;
+	buf[2] = 0;
+	buf[3] = 0;
+	memcpy(buf + sizeof(uint32_t), spec, len);
+	return qubes_jack_ctrl_send(c, QUBES_JACK_TLV_ROUTE, buf,
+				    sizeof(uint32_t) + len);
+}
+
+/*
+ * Send heartbeat, RTT ping and a batch of stats once per heartbeat
+ * interval.  Called from the control loop, never from the RT thread.
+ */
+void qubes_jack_ctrl_tick(struct qubes_jack_ctrl *c,
+			  const struct qubes_jack_stat *stats, unsigned int n)
+{
+	uint8_t buf[QUBES_JACK_TLV_MAX_VALUE];
+	uint64_t now = now_ns();
+	unsigned int i;
+
+	if (c->version < 2)
+		return;
+	if (now - c->last_tick_ns < QUBES_JACK_HEARTBEAT_MS * 1000000ULL)
+		return;
+	c->last_tick_ns = now;
+
+	qubes_jack_ctrl_send_u32(c, QUBES_JACK_TLV_HEARTBEAT, ++c->heartbeat_seq);
+
+	write_nth_u32(buf, 0, ++c->ping_seq);
+	write_nth_u64(buf, 1, now);
+	qubes_jack_ctrl_send(c, QUBES_JACK_TLV_PING, buf, 3 * sizeof(uint32_t));
+
+	if (n > QUBES_JACK_TLV_MAX_VALUE / (3 * sizeof(uint32_t)))
+		n = QUBES_JACK_TLV_MAX_VALUE / (3 * sizeof(uint32_t));
+	for (i = 0; i < n; i++) {
+		write_nth_u32(buf, 3 * i, stats[i].key);
+		write_nth_u64(buf, 3 * i + 1, stats[i].value);
+	}
+	if (n)
+		qubes_jack_ctrl_send(c, QUBES_JACK_TLV_STATS, buf,
+				     n * 3 * sizeof(uint32_t));
+}
+
+int qubes_jack_ctrl_send_meter(struct qubes_jack_ctrl *c, uint8_t direction,
+			       const struct qubes_jack_meter_values *v)
+{
+	uint8_t buf[(1 + 2 * MAX_CH) * sizeof(uint32_t)];
+	unsigned int i;
+
+	if (c->version < 2)
+		return -1;
+
+	buf[0] = direction;
+	buf[1] = v->channels;
+	buf[2] = 0;
+	buf[3] = 0;
+	for (i = 0; i < v->channels; i++) {
+		write_nth_float(buf, 1 + 2 * i, v->peak[i]);
+		write_nth_float(buf, 2 + 2 * i, v->rms[i]);
+	}
+	return qubes_jack_ctrl_send(c, QUBES_JACK_TLV_METER, buf,
+				    (1 + 2 * v->channels) * sizeof(uint32_t));
+}
+
+// RT safe: brackets the process callback for qubes_jack_rt_sync()
+void qubes_jack_rt_enter(struct qubes_jack_rt_sync *s)
+{
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+void qubes_jack_rt_leave(struct qubes_jack_rt_sync *s)
+{
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until no process callback that may have seen state the caller has
+ * just changed is still running; any later one sees the new state.  There
+ * is no timeout, since the callback may still be using what the caller is
+ * about to free: instead a stream wait in progress is cut short, so even a
+ * callback blocked on a hung peer returns promptly.
+ */
+void qubes_jack_rt_sync(struct qubes_jack_rt_sync *s)
+{
+	unsigned int seq;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST);
+	if (!(seq & 1))
+		return;
+
+	s->cancel = true;
+	while (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq)
+		usleep(1000);
+	s->cancel = false;
+}
+
+// RT safe
+void qubes_jack_hist_add(struct qubes_jack_hist *h, uint64_t ns)
+{
+	uint64_t b = ns / QUBES_JACK_HIST_BUCKET_NS;
+
+	if (b >= QUBES_JACK_HIST_BUCKETS)
+		b = QUBES_JACK_HIST_BUCKETS - 1;
+	h->bucket[b]++;
+	h->count++;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+/*
+ * Upper edge of the bucket holding the given percentile, in tenths of a
+ * percent.  Read from another thread while the RT thread updates it, so
+ * it is only approximate, which is good enough for a stats dump.
+ */
+uint64_t qubes_jack_hist_percentile(const struct qubes_jack_hist *h,
+				    unsigned int permille)
+{
+	uint64_t want = (h->count * permille + 999) / 1000;
+	uint64_t seen = 0;
+	unsigned int b;
+
+	if (!h->count)
+		return 0;
+	for (b = 0; b < QUBES_JACK_HIST_BUCKETS - 1; b++) {
+		seen += h->bucket[b];
+		if (seen >= want)
+			return (uint64_t)(b + 1) * QUBES_JACK_HIST_BUCKET_NS;
+	}
+	return h->max_ns;
+}
+
+void qubes_jack_hist_print(const struct qubes_jack_hist *h, FILE *f)
+{
+	fprintf(f, "callback: %" PRIu64 " cycles, p50 %" PRIu64 " us, p99 %"
+		PRIu64 " us, p99.9 %" PRIu64 " us, max %" PRIu64 " us\n",
+		h->count, qubes_jack_hist_percentile(h, 500) / 1000,
+		qubes_jack_hist_percentile(h, 990) / 1000,
+		qubes_jack_hist_percentile(h, 999) / 1000,
+		h->max_ns / 1000);
+}
+
+unsigned int qubes_jack_stream_stats(struct qubes_jack_stat *stats,
+				     unsigned int n, uint32_t base,
+				     const struct qubes_jack_stream *s)
+{
+	const uint64_t values[] = {
+		[QUBES_JACK_STAT_PERIODS] = s->stats.periods,
+		[QUBES_JACK_STAT_OVERFLOW] = s->stats.overflow_frames,
+		[QUBES_JACK_STAT_UNDERFLOW] = s->stats.underflow_frames,
+		[QUBES_JACK_STAT_DISCARDED] = s->stats.discarded_frames,
+		[QUBES_JACK_STAT_EXCURSIONS] = s->stats.latency_excursions,
+		[QUBES_JACK_STAT_TIMEOUTS] = s->stats.block_timeouts,
+		[QUBES_JACK_STAT_MAX_BACKLOG] = s->stats.max_backlog,
+		[QUBES_JACK_STAT_TRANSFERS] = s->stats.transfers,
+		[QUBES_JACK_STAT_CONCEALED] = s->stats.concealed_frames,
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		stats[n].key = base + i;
+		stats[n].value = values[i];
+		n++;
+	}
+	return n;
+}
+
+static const char *stat_field_names[] = {
+	[QUBES_JACK_STAT_PERIODS] = "periods",
+	[QUBES_JACK_STAT_OVERFLOW] = "overflow",
+	[QUBES_JACK_STAT_UNDERFLOW] = "underflow",
+	[QUBES_JACK_STAT_DISCARDED] = "discarded",
+	[QUBES_JACK_STAT_EXCURSIONS] = "excursions",
+	[QUBES_JACK_STAT_TIMEOUTS] = "timeouts",
+	[QUBES_JACK_STAT_MAX_BACKLOG] = "max_backlog",
+	[QUBES_JACK_STAT_TRANSFERS] = "transfers",
+	[QUBES_JACK_STAT_CONCEALED] = "concealed",
+};
+
+static void print_stat(const struct qubes_jack_stat *st, FILE *f)
+{
+	uint32_t base = st->key & ~0xff;
+	uint32_t field = st->key & 0xff;
+	const char *dir = NULL;
+
+	if (base == QUBES_JACK_STAT_PLAY_BASE)
+		dir = "playback";
+	else if (base == QUBES_JACK_STAT_REC_BASE)
+		dir = "record";
+
+	if (dir && field < sizeof(stat_field_names) / sizeof(stat_field_names[0]))
+		fprintf(f, " %s.%s=%" PRIu64, dir, stat_field_names[field], st->value);
+	else if (st->key == QUBES_JACK_STAT_XRUNS)
+		fprintf(f, " xruns=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_RECONNECTS)
+		fprintf(f, " reconnects=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_TTFA_US)
+		fprintf(f, " ttfa_us=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_CB_P99_US)
+		fprintf(f, " callback_p99_us=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_CB_MAX_US)
+		fprintf(f, " callback_max_us=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_QOS_CLASS)
+		fprintf(f, " qos_class=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_QOS_SHED)
+		fprintf(f, " qos_shed=%" PRIu64, st->value);
+	else if (st->key == QUBES_JACK_STAT_QOS_MISSES)
+		fprintf(f, " qos_deadline_misses=%" PRIu64, st->value);
+	else
+		fprintf(f, " 0x%" PRIx32 "=%" PRIu64, st->key, st->value);
+}
+
+void qubes_jack_ctrl_print(const struct qubes_jack_ctrl *c, FILE *f)
+{
+	unsigned int i;
+
+	fprintf(f, "control: protocol v%d", c->version);
+	if (c->pongs)
+		fprintf(f, ", rtt last %" PRIu64 " us, min %" PRIu64
+			" us, avg %" PRIu64 " us, max %" PRIu64 " us",
+			c->rtt_last_ns / 1000, c->rtt_min_ns / 1000,
+			c->rtt_avg_ns / 1000, c->rtt_max_ns / 1000);
+	fprintf(f, "\n");
+
+	if (c->peer_stats_count) {
+		fprintf(f, "peer:");
+		for (i = 0; i < c->peer_stats_count; i++)
+			print_stat(&c->peer_stats[i], f);
+		fprintf(f, "\n");
+	}
+
+	qubes_jack_meter_print(&c->peer_meter[QUBES_JACK_METER_PLAY],
+			       "peer playback meter", f);
+	qubes_jack_meter_print(&c->peer_meter[QUBES_JACK_METER_REC],
+			       "peer record meter", f);
+}
@@ -0,0 +1,127 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef QUBES_VCHAN_JACK_CONTROL_H
+#define QUBES_VCHAN_JACK_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "qubes-vchan-jack-transport.h"
+
+#include "qubes-vchan-jack.h"
+#include "qubes-vchan-jack-stream.h"
+#include "qubes-vchan-jack-meter.h"
+
+// Pseudo message types for the fixed size v1 packets
+#define QUBES_JACK_MSG_V1_QUERY QUBES_JACK_CONFIG_QUERY_CMD
+#define QUBES_JACK_MSG_V1_CONFIG QUBES_JACK_CONFIG_QUERY_START
+
+#define QUBES_JACK_MAX_STATS 64
+
+#define QUBES_JACK_METER_PLAY 0
+#define QUBES_JACK_METER_REC 1
+
+struct qubes_jack_msg {
+	uint8_t type;
+	uint16_t len;
+	uint8_t val[QUBES_JACK_TLV_MAX_VALUE];
+};
+
+struct qubes_jack_stat {
+	uint32_t key;
+	uint64_t value;
+};
+
+// Lets the control thread wait out a process callback in flight
+struct qubes_jack_rt_sync {
+	unsigned int seq;		// odd while the process callback runs
+	volatile bool cancel;		// cut blocking stream waits short
+};
+
+// Process callback run time, in fixed width buckets
+#define QUBES_JACK_HIST_BUCKETS 256
+#define QUBES_JACK_HIST_BUCKET_NS 10000
+
+struct qubes_jack_hist {
+	uint64_t count;
+	uint64_t max_ns;
+	uint32_t bucket[QUBES_JACK_HIST_BUCKETS];	// the last one takes the rest
+};
+
+struct qubes_jack_ctrl {
+	struct qubes_jack_chan *ctrl;
+	int version;			// 0 until negotiated
+	uint8_t rx[QUBES_JACK_TLV_HEADER_SIZE + QUBES_JACK_TLV_MAX_VALUE];
+	unsigned int rx_len;
+
+	uint32_t heartbeat_seq;
+	uint32_t ping_seq;
+	uint64_t last_tick_ns;
+	uint64_t last_heartbeat_ns;	// last heartbeat from the peer
+
+	uint64_t pongs;
+	uint64_t rtt_last_ns;
+	uint64_t rtt_min_ns;
+	uint64_t rtt_max_ns;
+	uint64_t rtt_avg_ns;
+	int64_t clock_offset_ns;	// peer monotonic clock minus ours
+
+	struct qubes_jack_stat peer_stats[QUBES_JACK_MAX_STATS];
+	unsigned int peer_stats_count;
+
+	struct qubes_jack_meter_values peer_meter[2];
+};
+
+void qubes_jack_ctrl_init(struct qubes_jack_ctrl *c, struct qubes_jack_chan *ctrl);
+int qubes_jack_ctrl_send(struct qubes_jack_ctrl *c, uint8_t type,
+			 const void *val, uint16_t len);
+int qubes_jack_ctrl_send_u32(struct qubes_jack_ctrl *c, uint8_t type,
+			     uint32_t value);
+int qubes_jack_ctrl_send_hello(struct qubes_jack_ctrl *c, unsigned int dirs);
+unsigned int qubes_jack_hello_dirs(const struct qubes_jack_msg *msg);
+int qubes_jack_ctrl_send_route(struct qubes_jack_ctrl *c, uint8_t direction,
+			       const char *spec);
+int qubes_jack_parse_dirs(const char *arg);
+const char *qubes_jack_dirs_name(unsigned int dirs);
+int qubes_jack_ctrl_recv(struct qubes_jack_ctrl *c, struct qubes_jack_msg *msg);
+bool qubes_jack_ctrl_handle_common(struct qubes_jack_ctrl *c,
+				   const struct qubes_jack_msg *msg);
+void qubes_jack_ctrl_tick(struct qubes_jack_ctrl *c,
+			  const struct qubes_jack_stat *stats, unsigned int n);
+int qubes_jack_ctrl_send_meter(struct qubes_jack_ctrl *c, uint8_t direction,
+			       const struct qubes_jack_meter_values *v);
+void qubes_jack_ctrl_print(const struct qubes_jack_ctrl *c, FILE *f);
+
+void qubes_jack_hist_add(struct qubes_jack_hist *h, uint64_t ns);
+uint64_t qubes_jack_hist_percentile(const struct qubes_jack_hist *h,
+				    unsigned int permille);
+void qubes_jack_hist_print(const struct qubes_jack_hist *h, FILE *f);
+
+void qubes_jack_rt_enter(struct qubes_jack_rt_sync *s);
+void qubes_jack_rt_leave(struct qubes_jack_rt_sync *s);
+void qubes_jack_rt_sync(struct qubes_jack_rt_sync *s);
+unsigned int qubes_jack_stream_stats(struct qubes_jack_stat *stats,
+				     unsigned int n, uint32_t base,
+				     const struct qubes_jack_stream *s);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "qubes-vchan-jack-transport.h"
+
+/*
+ * Shared memory channels between processes on one kernel, for containers
+ * and testing.  The server puts both rings in a memfd and listens on a
+ * UNIX socket, $QUBES_JACK_MEMFD_DIR/qubes-jack-<domain>-<port>.sock
+ * (default /tmp); both ends must be given the same domain number.  The
+ * client gets the memfd and an eventfd per side over the socket, and keeps
+ * the connection open so the server notices when it goes away.
+ *
+ * The client can write to the whole mapping, so the server never trusts
+ * the shared header: ring sizes and offsets are copied out when the
+ * channel is set up, each side keeps its own index privately and clamps
+ * the peer's, and whether the client is connected is only known to the
+ * listener thread.
+ */
+
+#define MEMFD_MAGIC 0x514a4d46	// "QJMF"
+#define CACHE_LINE 64
+
+#define CLIENT_NONE 0
+#define CLIENT_CONNECTED 1
+#define CLIENT_GONE 2
+
+// Reader and writer indices on their own cache lines
+struct memfd_ring {
+	uint64_t wr __attribute__((aligned(CACHE_LINE)));
+	uint64_t rd __attribute__((aligned(CACHE_LINE)));
+	uint64_t size __attribute__((aligned(CACHE_LINE)));
+	uint64_t offset;		// of the data from the start of the mapping
+};
+
+struct memfd_header {
+	uint32_t magic;
+	uint32_t server_open;
+	struct memfd_ring ring[2];	// [0] client to server, [1] server to client
+};
+
+struct memfd_chan {
+	struct qubes_jack_chan base;
+	struct memfd_header *hdr;
+	size_t map_size;
+	bool server;
+	struct memfd_ring *rx;
+	struct memfd_ring *tx;
+	int notify_fd;			// signalled by the peer
+	int peer_fd;			// signalled by us
+
+	// Private copies of the rings' layout and our own indices
+	uint8_t *rx_buf;
+	uint8_t *tx_buf;
+	size_t rx_size;
+	size_t tx_size;
+	uint64_t rx_pos;		// read index, published as rx->rd
+	uint64_t tx_pos;		// write index, published as tx->wr
+
+	// server only
+	int client_state;		// CLIENT_*, set by the listener thread
+	int memfd;
+	int listen_fd;
+	int conn_fd;
+	int closing;
+	bool listening;
+	pthread_t thread;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+	// client only
+	int sock_fd;
+};
+
+static struct memfd_chan *memfd_of(struct qubes_jack_chan *c)
+{
+	return (struct memfd_chan *)c;
+}
+
+static int memfd_path(char *path, size_t len, int domain, int port)
+{
+	const char *dir = getenv("QUBES_JACK_MEMFD_DIR");
+	int n;
+
+	n = snprintf(path, len, "%s/qubes-jack-%d-%d.sock", dir ? dir : "/tmp",
+		     domain, port);
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+static void memfd_notify(struct memfd_chan *c)
+{
+	eventfd_write(c->peer_fd, 1);
+}
+
+static int send_fds(int sock, const int *fds, unsigned int n)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_fds(int sock, int *fds, unsigned int n)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	return 0;
+}
+
+/*
+ * Hand the client its descriptors, then sit on the connection until it
+ * hangs up, however it goes away.  Keeps accept() and the blocking read
+ * away from the RT thread, which only ever looks at client_state.
+ */
+static void *memfd_listen(void *arg)
+{
+	struct memfd_chan *c = arg;
+	int fds[3] = { c->memfd, c->peer_fd, c->notify_fd };
+	char byte;
+	ssize_t n;
+	int fd;
+
+	fd = accept4(c->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	__atomic_store_n(&c->conn_fd, fd, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->closing, __ATOMIC_SEQ_CST) ||
+	    send_fds(fd, fds, 3))
+		return NULL;
+
+	__atomic_store_n(&c->client_state, CLIENT_CONNECTED, __ATOMIC_RELEASE);
+	eventfd_write(c->notify_fd, 1);
+
+	do {
+		n = read(fd, &byte, 1);
+	} while (n > 0 || (n < 0 && errno == EINTR));
+
+	__atomic_store_n(&c->client_state, CLIENT_GONE, __ATOMIC_RELEASE);
+	eventfd_write(c->notify_fd, 1);
+	return NULL;
+}
+
+static struct memfd_chan *memfd_alloc(bool server)
+{
+	struct memfd_chan *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+	c->base.t = &qubes_jack_transport_memfd;
+	c->hdr = MAP_FAILED;
+	c->server = server;
+	c->notify_fd = -1;
+	c->peer_fd = -1;
+	c->memfd = -1;
+	c->listen_fd = -1;
+	c->conn_fd = -1;
+	c->sock_fd = -1;
+	return c;
+}
+
+static void memfd_free(struct memfd_chan *c)
+{
+	if (c->listening) {
+		__atomic_store_n(&c->closing, 1, __ATOMIC_SEQ_CST);
+		shutdown(c->listen_fd, SHUT_RDWR);
+		if (__atomic_load_n(&c->conn_fd, __ATOMIC_SEQ_CST) >= 0)
+			shutdown(c->conn_fd, SHUT_RDWR);
+		pthread_join(c->thread, NULL);
+	}
+	if (c->listen_fd >= 0) {
+		close(c->listen_fd);
+		unlink(c->path);
+	}
+	if (c->conn_fd >= 0)
+		close(c->conn_fd);
+	if (c->sock_fd >= 0)
+		close(c->sock_fd);
+	if (c->hdr != MAP_FAILED)
+		munmap(c->hdr, c->map_size);
+	if (c->memfd >= 0)
+		close(c->memfd);
+	if (c->notify_fd >= 0)
+		close(c->notify_fd);
+	if (c->peer_fd >= 0)
+		close(c->peer_fd);
+	free(c);
+}
+
+static int ring_layout(struct memfd_chan *c, struct memfd_ring *r,
+		       uint8_t **buf, size_t *size)
+{
+	uint64_t offset = r->offset;
+	uint64_t len = r->size;
+
+	if (!len || offset < sizeof(struct memfd_header) ||
+	    offset > c->map_size || len > c->map_size - offset)
+		return -1;
+	*buf = (uint8_t *)c->hdr + offset;
+	*size = len;
+	return 0;
+}
+
+// Take the layout from the header once; only indices are shared after this
+static int memfd_attach(struct memfd_chan *c)
+{
+	c->rx = &c->hdr->ring[c->server ? 0 : 1];
+	c->tx = &c->hdr->ring[c->server ? 1 : 0];
+	if (ring_layout(c, c->rx, &c->rx_buf, &c->rx_size) ||
+	    ring_layout(c, c->tx, &c->tx_buf, &c->tx_size))
+		return -1;
+	c->rx_pos = __atomic_load_n(&c->rx->rd, __ATOMIC_ACQUIRE);
+	c->tx_pos = __atomic_load_n(&c->tx->wr, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+static struct qubes_jack_chan *memfd_server_init(int domain, int port,
+						 size_t read_min,
+						 size_t write_min)
+{
+	size_t hdr_size = (sizeof(struct memfd_header) + CACHE_LINE - 1) &
+		~(size_t)(CACHE_LINE - 1);
+	size_t read_size = (read_min + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	struct sockaddr_un addr;
+	struct memfd_chan *c;
+
+	c = memfd_alloc(true);
+	if (!c)
+		return NULL;
+
+	c->map_size = hdr_size + read_size + write_min;
+	c->memfd = memfd_create("qubes-jack", MFD_CLOEXEC);
+	if (c->memfd < 0 || ftruncate(c->memfd, c->map_size))
+		goto fail;
+	c->hdr = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      c->memfd, 0);
+	if (c->hdr == MAP_FAILED)
+		goto fail;
+
+	c->hdr->ring[0].size = read_min;
+	c->hdr->ring[0].offset = hdr_size;
+	c->hdr->ring[1].size = write_min;
+	c->hdr->ring[1].offset = hdr_size + read_size;
+	c->hdr->server_open = 1;
+	c->hdr->magic = MEMFD_MAGIC;
+	if (memfd_attach(c))
+		goto fail;
+
+	c->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->notify_fd < 0 || c->peer_fd < 0)
+		goto fail;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (memfd_path(addr.sun_path, sizeof(addr.sun_path), domain, port))
+		goto fail;
+	c->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->listen_fd < 0)
+		goto fail;
+	unlink(addr.sun_path);
+	if (bind(c->listen_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(c->listen_fd);
+		c->listen_fd = -1;
+		goto fail;
+	}
+	memcpy(c->path, addr.sun_path, sizeof(c->path));
+	if (listen(c->listen_fd, 1))
+		goto fail;
+
+	if (pthread_create(&c->thread, NULL, memfd_listen, c))
+		goto fail;
+	c->listening = true;
+	return &c->base;
+
+fail:
+	memfd_free(c);
+	return NULL;
+}
+
+static struct qubes_jack_chan *memfd_client_init(int domain, int port)
+{
+	struct timeval timeout = { 1, 0 };
+	struct sockaddr_un addr;
+	struct memfd_chan *c;
+	struct stat st;
+	int fds[3];
+
+	c = memfd_alloc(false);
+	if (!c)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (memfd_path(addr.sun_path, sizeof(addr.sun_path), domain, port))
+		goto fail;
+	c->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->sock_fd < 0 ||
+	    connect(c->sock_fd, (struct sockaddr *)&addr, sizeof(addr)))
+		goto fail;
+	// A server that already has its client leaves us in the backlog
+	setsockopt(c->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (recv_fds(c->sock_fd, fds, 3))
+		goto fail;
+
+	c->memfd = fds[0];
+	c->notify_fd = fds[1];
+	c->peer_fd = fds[2];
+
+	if (fstat(c->memfd, &st) || (size_t)st.st_size < sizeof(struct memfd_header))
+		goto fail;
+	c->map_size = st.st_size;
+	c->hdr = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      c->memfd, 0);
+	if (c->hdr == MAP_FAILED || c->hdr->magic != MEMFD_MAGIC ||
+	    memfd_attach(c))
+		goto fail;
+
+	// The mapping keeps the memory alive
+	close(c->memfd);
+	c->memfd = -1;
+	return &c->base;
+
+fail:
+	memfd_free(c);
+	return NULL;
+}
+
+// Bytes between two indices, whatever the peer has written to its own
+static size_t ring_used(uint64_t head, uint64_t tail, size_t size)
+{
+	uint64_t used = head - tail;
+
+	return used > size ? size : used;
+}
+
+static size_t rx_ready(struct memfd_chan *c)
+{
+	return ring_used(__atomic_load_n(&c->rx->wr, __ATOMIC_ACQUIRE),
+			 c->rx_pos, c->rx_size);
+}
+
+static size_t tx_space(struct memfd_chan *c)
+{
+	return c->tx_size - ring_used(c->tx_pos,
+				      __atomic_load_n(&c->tx->rd, __ATOMIC_ACQUIRE),
+				      c->tx_size);
+}
+
+static int memfd_data_ready(struct qubes_jack_chan *chan)
+{
+	return rx_ready(memfd_of(chan));
+}
+
+static int memfd_buffer_space(struct qubes_jack_chan *chan)
+{
+	return tx_space(memfd_of(chan));
+}
+
+static int memfd_write(struct qubes_jack_chan *chan, const void *data,
+		       size_t size)
+{
+	struct memfd_chan *c = memfd_of(chan);
+	size_t space = tx_space(c);
+	size_t off, first;
+
+	if (size > space)
+		size = space;
+	if (!size)
+		return 0;
+	off = c->tx_pos % c->tx_size;
+	first = c->tx_size - off < size ? c->tx_size - off : size;
+	memcpy(c->tx_buf + off, data, first);
+	memcpy(c->tx_buf, (const uint8_t *)data + first, size - first);
+	c->tx_pos += size;
+	__atomic_store_n(&c->tx->wr, c->tx_pos, __ATOMIC_RELEASE);
+	memfd_notify(c);
+	return size;
+}
+
+static int memfd_read(struct qubes_jack_chan *chan, void *data, size_t size)
+{
+	struct memfd_chan *c = memfd_of(chan);
+	size_t ready = rx_ready(c);
+	size_t off, first;
+
+	if (size > ready)
+		size = ready;
+	if (!size)
+		return 0;
+	off = c->rx_pos % c->rx_size;
+	first = c->rx_size - off < size ? c->rx_size - off : size;
+	memcpy(data, c->rx_buf + off, first);
+	memcpy((uint8_t *)data + first, c->rx_buf, size - first);
+	c->rx_pos += size;
+	__atomic_store_n(&c->rx->rd, c->rx_pos, __ATOMIC_RELEASE);
+	memfd_notify(c);
+	return size;
+}
+
+static int memfd_fd_for_select(struct qubes_jack_chan *chan)
+{
+	return memfd_of(chan)->notify_fd;
+}
+
+static int memfd_wait(struct qubes_jack_chan *chan)
+{
+	eventfd_t v;
+
+	eventfd_read(memfd_of(chan)->notify_fd, &v);
+	return 0;
+}
+
+static int memfd_is_open(struct qubes_jack_chan *chan)
+{
+	struct memfd_chan *c = memfd_of(chan);
+
+	if (!c->server) {
+		// A server that crashed never clears server_open, but its
+		// end of the socket goes away all the same
+		struct pollfd pfd = { .fd = c->sock_fd, .events = 0 };
+
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+			return 0;
+		return __atomic_load_n(&c->hdr->server_open, __ATOMIC_ACQUIRE);
+	}
+
+	switch (__atomic_load_n(&c->client_state, __ATOMIC_ACQUIRE)) {
+	case CLIENT_NONE:
+		return 2;
+	case CLIENT_CONNECTED:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void memfd_close(struct qubes_jack_chan *chan)
+{
+	struct memfd_chan *c = memfd_of(chan);
+
+	if (c->server)
+		__atomic_store_n(&c->hdr->server_open, 0, __ATOMIC_RELEASE);
+	memfd_notify(c);
+	memfd_free(c);
+}
+
+const struct qubes_jack_transport qubes_jack_transport_memfd = {
+	.name = "memfd",
+	.server_init = memfd_server_init,
+	.client_init = memfd_client_init,
+	.data_ready = memfd_data_ready,
+	.buffer_space = memfd_buffer_space,
+	.read = memfd_read,
+	.write = memfd_write,
+	.fd_for_select = memfd_fd_for_select,
+	.wait = memfd_wait,
+	.is_open = memfd_is_open,
+	.close = memfd_close,
+};
@@ -0,0 +1,173 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "qubes-vchan-jack-memvchan.h"
+
+struct mem_chan {
+	struct qubes_jack_chan base;
+	uint8_t *buf;
+	size_t size;
+	size_t rd;		// monotonic, wraps with size
+	size_t wr;
+};
+
+static const struct qubes_jack_transport mem_transport;
+
+static struct mem_chan *mem_of(struct qubes_jack_chan *c)
+{
+	return (struct mem_chan *)c;
+}
+
+struct qubes_jack_chan *qubes_jack_memvchan_new(size_t size)
+{
+	struct mem_chan *ctrl = calloc(1, sizeof(*ctrl));
+
+	if (!ctrl)
+		return NULL;
+	ctrl->buf = malloc(size);
+	if (!ctrl->buf) {
+		free(ctrl);
+		return NULL;
+	}
+	ctrl->base.t = &mem_transport;
+	ctrl->size = size;
+	return &ctrl->base;
+}
+
+static size_t ring_put(struct mem_chan *ctrl, const void *data, size_t size)
+{
+	size_t space = ctrl->size - (ctrl->wr - ctrl->rd);
+	size_t off, first;
+
+	if (size > space)
+		size = space;
+	off = ctrl->wr % ctrl->size;
+	first = ctrl->size - off < size ? ctrl->size - off : size;
+	memcpy(ctrl->buf + off, data, first);
+	memcpy(ctrl->buf, (const uint8_t *)data + first, size - first);
+	ctrl->wr += size;
+	return size;
+}
+
+static size_t ring_get(struct mem_chan *ctrl, void *data, size_t size)
+{
+	size_t ready = ctrl->wr - ctrl->rd;
+	size_t off, first;
+
+	if (size > ready)
+		size = ready;
+	off = ctrl->rd % ctrl->size;
+	first = ctrl->size - off < size ? ctrl->size - off : size;
+	memcpy(data, ctrl->buf + off, first);
+	memcpy((uint8_t *)data + first, ctrl->buf, size - first);
+	ctrl->rd += size;
+	return size;
+}
+
+size_t qubes_jack_memvchan_push(struct qubes_jack_chan *ctrl, const void *data,
+				size_t size)
+{
+	return ring_put(mem_of(ctrl), data, size);
+}
+
+size_t qubes_jack_memvchan_pull(struct qubes_jack_chan *ctrl, void *data,
+				size_t size)
+{
+	return ring_get(mem_of(ctrl), data, size);
+}
+
+static struct qubes_jack_chan *mem_server_init(int domain, int port,
+					       size_t read_min, size_t write_min)
+{
+	(void)domain;
+	(void)port;
+	return qubes_jack_memvchan_new(read_min > write_min ? read_min : write_min);
+}
+
+static struct qubes_jack_chan *mem_client_init(int domain, int port)
+{
+	(void)domain;
+	(void)port;
+	return NULL;
+}
+
+static int mem_write(struct qubes_jack_chan *ctrl, const void *data, size_t size)
+{
+	return ring_put(mem_of(ctrl), data, size);
+}
+
+static int mem_read(struct qubes_jack_chan *ctrl, void *data, size_t size)
+{
+	return ring_get(mem_of(ctrl), data, size);
+}
+
+static int mem_wait(struct qubes_jack_chan *ctrl)
+{
+	(void)ctrl;
+	return 0;
+}
+
+static void mem_close(struct qubes_jack_chan *ctrl)
+{
+	free(mem_of(ctrl)->buf);
+	free(ctrl);
+}
+
+static int mem_fd_for_select(struct qubes_jack_chan *ctrl)
+{
+	(void)ctrl;
+	return -1;
+}
+
+static int mem_is_open(struct qubes_jack_chan *ctrl)
+{
+	(void)ctrl;
+	return 1;
+}
+
+static int mem_data_ready(struct qubes_jack_chan *ctrl)
+{
+	return mem_of(ctrl)->wr - mem_of(ctrl)->rd;
+}
+
+static int mem_buffer_space(struct qubes_jack_chan *ctrl)
+{
+	return mem_of(ctrl)->size - (mem_of(ctrl)->wr - mem_of(ctrl)->rd);
+}
+
+static const struct qubes_jack_transport mem_transport = {
+	.name = "mem",
+	.server_init = mem_server_init,
+	.client_init = mem_client_init,
+	.data_ready = mem_data_ready,
+	.buffer_space = mem_buffer_space,
+	.read = mem_read,
+	.write = mem_write,
+	.fd_for_select = mem_fd_for_select,
+	.wait = mem_wait,
+	.is_open = mem_is_open,
+	.close = mem_close,
+};
@@ -0,0 +1,43 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef QUBES_VCHAN_JACK_MEMVCHAN_H
+#define QUBES_VCHAN_JACK_MEMVCHAN_H
+
+#include <stddef.h>
+
+#include "qubes-vchan-jack-transport.h"
+
+/*
+ * A process-local transport for the offline tools.  Each channel is a
+ * single in-memory ring: whatever is pushed with qubes_jack_memvchan_push()
+ * is what qubes_jack_chan_read() returns, and qubes_jack_chan_write()
+ * output can be taken back out with qubes_jack_memvchan_pull().  Nothing
+ * ever blocks.
+ */
+struct qubes_jack_chan *qubes_jack_memvchan_new(size_t size);
+size_t qubes_jack_memvchan_push(struct qubes_jack_chan *ctrl, const void *data,
+				size_t size);
+size_t qubes_jack_memvchan_pull(struct qubes_jack_chan *ctrl, void *data,
+				size_t size);
+
+#endif
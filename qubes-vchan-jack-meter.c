@@ -0,0 +1,174 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "qubes-vchan-jack-meter.h"
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+void qubes_jack_meter_init(struct qubes_jack_meter *m, unsigned int sample_rate,
+			   unsigned int interval_ms)
+{
+	memset(m, 0, sizeof(*m));
+	qubes_jack_meter_set_rate(m, sample_rate, interval_ms);
+}
+
+// Keep the window at interval_ms after a sample rate change
+void qubes_jack_meter_set_rate(struct qubes_jack_meter *m,
+				unsigned int sample_rate,
+				unsigned int interval_ms)
+{
+	__atomic_store_n(&m->window, (uint64_t)sample_rate * interval_ms / 1000,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Four lanes at a time with GCC vector extensions, which become SSE/NEON
+ * without tying the code to one instruction set.  JACK buffers are
+ * normally 16 byte aligned, but loads go through memcpy so they don't
+ * have to be.
+ */
+static void meter_kernel(const float *buf, uint32_t n, float *peak,
+			 double *sumsq)
+{
+	const v4si absmask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+	v4sf vmax = { 0.f, 0.f, 0.f, 0.f };
+	v4sf vsum = { 0.f, 0.f, 0.f, 0.f };
+	float max, sum, a;
+	uint32_t i = 0;
+	int k;
+
+	for (; i + 4 <= n; i += 4) {
+		v4sf x, ax;
+		v4si gt;
+
+		memcpy(&x, buf + i, sizeof(x));
+		ax = (v4sf)((v4si)x & absmask);
+		gt = ax > vmax;
+		vmax = (v4sf)(((v4si)ax & gt) | ((v4si)vmax & ~gt));
+		vsum += x * x;
+	}
+
+	max = *peak;
+	sum = 0.f;
+	for (k = 0; k < 4; k++) {
+		if (vmax[k] > max)
+			max = vmax[k];
+		sum += vsum[k];
+	}
+	for (; i < n; i++) {
+		a = fabsf(buf[i]);
+		if (a > max)
+			max = a;
+		sum += buf[i] * buf[i];
+	}
+
+	*peak = max;
+	*sumsq += sum;
+}
+
+static void meter_publish(struct qubes_jack_meter *m, unsigned int channels)
+{
+	unsigned int c;
+
+	__atomic_add_fetch(&m->seq, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	m->snap.channels = channels;
+	for (c = 0; c < channels; c++) {
+		m->snap.peak[c] = m->peak[c];
+		m->snap.rms[c] = sqrtf(m->sumsq[c] / m->frames);
+		m->peak[c] = 0.f;
+		m->sumsq[c] = 0.;
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_add_fetch(&m->seq, 1, __ATOMIC_RELEASE);
+	m->frames = 0;
+}
+
+void qubes_jack_meter_run(struct qubes_jack_meter *m, float **bufs,
+			  unsigned int channels, uint32_t nframes)
+{
+	unsigned int c;
+
+	if (!m->window)
+		return;
+	if (channels > MAX_CH)
+		channels = MAX_CH;
+
+	for (c = 0; c < channels; c++)
+		meter_kernel(bufs[c], nframes, &m->peak[c], &m->sumsq[c]);
+
+	m->frames += nframes;
+	if (m->frames >= m->window)
+		meter_publish(m, channels);
+}
+
+/*
+ * Copy out the latest snapshot if it is newer than *last_seq.  Never waits
+ * on the RT thread; a torn read is simply retried.
+ */
+bool qubes_jack_meter_read(struct qubes_jack_meter *m, uint32_t *last_seq,
+			   struct qubes_jack_meter_values *out)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		if (seq == *last_seq)
+			return false;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		memcpy(out, &m->snap, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE));
+
+	*last_seq = seq;
+	return true;
+}
+
+static float to_dbfs(float v)
+{
+	return v > 1e-10f ? 20.f * log10f(v) : -200.f;
+}
+
+void qubes_jack_meter_print(const struct qubes_jack_meter_values *v,
+			    const char *name, FILE *f)
+{
+	unsigned int c;
+
+	if (!v->channels)
+		return;
+
+	fprintf(f, "%s (dBFS peak/rms):", name);
+	for (c = 0; c < v->channels; c++)
+		fprintf(f, " %u: %.1f/%.1f", c + 1, to_dbfs(v->peak[c]),
+			to_dbfs(v->rms[c]));
+	fprintf(f, "\n");
+}
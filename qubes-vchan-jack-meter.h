@@ -0,0 +1,65 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef QUBES_VCHAN_JACK_METER_H
+#define QUBES_VCHAN_JACK_METER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "qubes-vchan-jack.h"
+
+struct qubes_jack_meter_values {
+	unsigned int channels;
+	float peak[MAX_CH];		// linear, 1.0 is full scale
+	float rms[MAX_CH];
+};
+
+/*
+ * Peak and RMS per channel over a window of frames.  The RT thread feeds
+ * it and publishes a snapshot at the end of each window under a sequence
+ * count, so readers on other threads never block it.
+ */
+struct qubes_jack_meter {
+	unsigned int window;		// frames per snapshot, 0: off
+	unsigned int frames;
+	float peak[MAX_CH];
+	double sumsq[MAX_CH];
+
+	volatile uint32_t seq;		// odd while a snapshot is being written
+	struct qubes_jack_meter_values snap;
+};
+
+void qubes_jack_meter_init(struct qubes_jack_meter *m, unsigned int sample_rate,
+			   unsigned int interval_ms);
+void qubes_jack_meter_set_rate(struct qubes_jack_meter *m,
+				unsigned int sample_rate,
+				unsigned int interval_ms);
+void qubes_jack_meter_run(struct qubes_jack_meter *m, float **bufs,
+			  unsigned int channels, uint32_t nframes);
+bool qubes_jack_meter_read(struct qubes_jack_meter *m, uint32_t *last_seq,
+			   struct qubes_jack_meter_values *out);
+void qubes_jack_meter_print(const struct qubes_jack_meter_values *v,
+			    const char *name, FILE *f);
+
+#endif
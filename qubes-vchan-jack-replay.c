@@ -0,0 +1,381 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Replay a capture written with -w through the same stream logic the
+ * process callbacks use, as fast as the CPU allows.  Receiving streams get
+ * the peer's bytes fed into an in-memory ring at the points the capture saw
+ * them queued, so underruns, backlog trimming and batching behave as they
+ * did in the field, or as they would with other settings.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "qubes-vchan-jack.h"
+#include "qubes-vchan-jack-stream.h"
+#include "qubes-vchan-jack-capture.h"
+#include "qubes-vchan-jack-memvchan.h"
+
+#define REPLAY_RING_SIZE (16 * 1024 * 1024)
+
+struct replay_stream {
+	struct qubes_jack_stream s;
+	struct qubes_jack_chan *ring;
+	bool receiving;
+	bool seen;
+
+	uint8_t *data;		// everything the stream moved over the vchan
+	size_t data_len;
+	size_t data_cap;
+	size_t consumed;	// by the captured run, up to the current record
+	size_t pushed;		// into our ring, or handed to the send path
+
+	uint64_t frames;
+	uint64_t busy_ns;
+	FILE *out;
+};
+
+static float bufs_mem[MAX_CH][MAX_JACK_BUFFER];
+static char scratch[QUBES_JACK_SCRATCH_SIZE];
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p policy] [-r policy] [-l frames] [-b periods] [-o prefix] <capture>\n", prog);
+	fprintf(stderr, "  -p  playback policy, -r record policy (default: drop-newest)\n");
+	fprintf(stderr, "  -l  frames queued beyond a period before latency is trimmed\n");
+	fprintf(stderr, "  -b  periods per transfer (default: as captured)\n");
+	fprintf(stderr, "  -o  write received audio to <prefix>.playback.f32 / .record.f32\n");
+}
+
+static int append(struct replay_stream *r, const void *data, size_t len)
+{
+	uint8_t *p;
+
+	if (r->data_len + len > r->data_cap) {
+		size_t cap = r->data_cap ? r->data_cap * 2 : 1 << 20;
+		while (cap < r->data_len + len)
+			cap *= 2;
+		p = realloc(r->data, cap);
+		if (!p)
+			return -1;
+		r->data = p;
+		r->data_cap = cap;
+	}
+	memcpy(r->data + r->data_len, data, len);
+	r->data_len += len;
+	return 0;
+}
+
+static const struct qubes_jack_capture_record *next_record(const uint8_t *map,
+		size_t size, size_t *offset)
+{
+	const struct qubes_jack_capture_record *rec;
+	size_t total;
+
+	if (*offset + sizeof(*rec) > size)
+		return NULL;
+	rec = (const struct qubes_jack_capture_record *)(map + *offset);
+	total = sizeof(*rec) + ((rec->len + 7) & ~7);
+	if (!rec->type || *offset + total > size)
+		return NULL;
+	*offset += total;
+	return rec;
+}
+
+/*
+ * Batch both streams as the captured run did from here on.  Not after
+ * -b, which holds one batch for the whole replay.
+ */
+static int replay_info(struct replay_stream *streams,
+		       const struct qubes_jack_capture_info *info)
+{
+	unsigned int batch[2];
+	int i;
+
+	batch[QUBES_JACK_CAP_STREAM_PLAY] = info->batch;
+	batch[QUBES_JACK_CAP_STREAM_REC] = info->rec_batch ? info->rec_batch
+							   : info->batch;
+	for (i = 0; i < 2; i++) {
+		if (batch[i] == streams[i].s.batch)
+			continue;
+		if (qubes_jack_stream_set_batch(&streams[i].s, batch[i])) {
+			fprintf(stderr, "Can't batch %u periods\n", batch[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void replay_period(struct replay_stream *r,
+			  const struct qubes_jack_capture_period *p)
+{
+	float *bufs[MAX_CH];
+	size_t j = p->channels * p->nframes * sizeof(float);
+	size_t target, n;
+	uint64_t start;
+	unsigned int c;
+	long f;
+
+	if (p->channels > MAX_CH || p->nframes > MAX_JACK_BUFFER)
+		return;
+	for (c = 0; c < p->channels; c++)
+		bufs[c] = bufs_mem[c];
+
+	if (p->receiving) {
+		// Feed what the peer had delivered by the time this period ran
+		if (p->ready >= 0) {
+			target = r->consumed + p->ready;
+			if (target > r->data_len)
+				target = r->data_len;
+			if (target > r->pushed)
+				r->pushed += qubes_jack_memvchan_push(r->ring,
+						r->data + r->pushed,
+						target - r->pushed);
+		}
+		start = now_ns();
+		qubes_jack_stream_recv(&r->s, bufs, p->channels, p->nframes,
+				       scratch);
+		r->busy_ns += now_ns() - start;
+
+		if (r->out) {
+			for (f = 0; f < p->nframes; f++)
+				for (c = 0; c < p->channels; c++)
+					fwrite(&bufs[c][f], sizeof(float), 1, r->out);
+		}
+	} else {
+		// Rebuild the JACK buffers from what was sent
+		for (c = 0; c < p->channels; c++) {
+			for (f = 0; f < p->nframes; f++) {
+				size_t i = r->pushed + (c + f * p->channels) * sizeof(float);
+				bufs[c][f] = i + sizeof(float) <= r->data_len ?
+					read_nth_float(r->data + r->pushed,
+						       c + f * p->channels) : 0.f;
+			}
+		}
+		r->pushed += j;
+
+		start = now_ns();
+		qubes_jack_stream_send(&r->s, bufs, p->channels, p->nframes,
+				       scratch);
+		r->busy_ns += now_ns() - start;
+
+		// The peer drains everything
+		do {
+			n = qubes_jack_memvchan_pull(r->ring, scratch, sizeof(scratch));
+		} while (n);
+	}
+	r->frames += p->nframes;
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_stream streams[2];
+	const struct qubes_jack_capture_header *hdr;
+	const struct qubes_jack_capture_record *rec;
+	const struct qubes_jack_capture_info *info = NULL;
+	const char *names[2] = { "playback", "record" };
+	const char *out_prefix = NULL;
+	const char *play_policy = NULL, *rec_policy = NULL;
+	unsigned int max_latency = 0, batch = 0, sample_rate = 48000;
+	uint64_t periods = 0;
+	size_t offset, size;
+	struct stat st;
+	uint8_t *map;
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "p:r:l:b:o:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			play_policy = optarg;
+			break;
+		case 'r':
+			rec_policy = optarg;
+			break;
+		case 'l':
+			max_latency = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'o':
+			out_prefix = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Can't open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	hdr = (const struct qubes_jack_capture_header *)map;
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+			memcmp(hdr->magic, QUBES_JACK_CAPTURE_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s is not a capture\n", argv[optind]);
+		return 1;
+	}
+	size = hdr->size && hdr->size <= (uint64_t)st.st_size ? hdr->size : (size_t)st.st_size;
+
+	memset(streams, 0, sizeof(streams));
+	for (i = 0; i < 2; i++) {
+		qubes_jack_stream_init(&streams[i].s, names[i]);
+		streams[i].ring = qubes_jack_memvchan_new(REPLAY_RING_SIZE);
+		if (!streams[i].ring)
+			return 1;
+		qubes_jack_stream_reset(&streams[i].s, streams[i].ring);
+	}
+	if ((play_policy && qubes_jack_parse_policy(&streams[0].s, play_policy)) ||
+	    (rec_policy && qubes_jack_parse_policy(&streams[1].s, rec_policy))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// First pass: collect each stream's byte stream and the settings
+	offset = sizeof(*hdr);
+	while ((rec = next_record(map, size, &offset))) {
+		if (rec->type == QUBES_JACK_CAP_INFO && !info)
+			info = (const struct qubes_jack_capture_info *)(rec + 1);
+		if (rec->stream > QUBES_JACK_CAP_STREAM_REC)
+			continue;
+		switch (rec->type) {
+		case QUBES_JACK_CAP_SEND:
+		case QUBES_JACK_CAP_RECV:
+		case QUBES_JACK_CAP_DISCARD:
+			if (append(&streams[rec->stream], rec + 1, rec->len))
+				return 1;
+			break;
+		case QUBES_JACK_CAP_PERIOD:
+			streams[rec->stream].seen = true;
+			streams[rec->stream].receiving =
+				((const struct qubes_jack_capture_period *)(rec + 1))->receiving;
+			break;
+		}
+	}
+	if (info) {
+		sample_rate = info->sample_rate;
+		fprintf(stderr, "Capture from the %s at %u Hz, %u periods per transfer\n",
+			info->role == QUBES_JACK_CAP_ROLE_SERVER ? "server" : "client",
+			info->sample_rate, info->batch);
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct qubes_jack_stream *s = &streams[i].s;
+
+		s->sample_rate = sample_rate;
+		s->max_latency = max_latency;
+		// Arrivals are replayed per period, waiting can't bring more data
+		if (s->policy == QUBES_JACK_POLICY_BLOCK) {
+			fprintf(stderr, "%s: block replays as drop-newest\n", names[i]);
+			s->policy = QUBES_JACK_POLICY_DROP_NEWEST;
+		}
+		if (batch > 1 && qubes_jack_stream_set_batch(s, batch)) {
+			fprintf(stderr, "Can't batch %u periods\n", batch);
+			return 1;
+		}
+		if (out_prefix && streams[i].seen && streams[i].receiving) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s.%s.f32", out_prefix, names[i]);
+			streams[i].out = fopen(path, "w");
+			if (!streams[i].out) {
+				fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+				return 1;
+			}
+		}
+	}
+
+	// Second pass: run every period in capture order
+	offset = sizeof(*hdr);
+	while ((rec = next_record(map, size, &offset))) {
+		struct replay_stream *r;
+
+		if (rec->type == QUBES_JACK_CAP_INFO && !batch &&
+		    rec->len >= sizeof(*info) &&
+		    replay_info(streams, (const struct qubes_jack_capture_info *)(rec + 1)))
+			return 1;
+		if (rec->stream > QUBES_JACK_CAP_STREAM_REC)
+			continue;
+		r = &streams[rec->stream];
+
+		switch (rec->type) {
+		case QUBES_JACK_CAP_PERIOD:
+			replay_period(r, (const struct qubes_jack_capture_period *)(rec + 1));
+			periods++;
+			break;
+		case QUBES_JACK_CAP_RECV:
+		case QUBES_JACK_CAP_DISCARD:
+			r->consumed += rec->len;
+			break;
+		}
+	}
+
+	fprintf(stderr, "Replayed %" PRIu64 " periods", periods);
+	if (hdr->dropped)
+		fprintf(stderr, " (capture was full, %" PRIu64 " records lost)",
+			(uint64_t)hdr->dropped);
+	fprintf(stderr, "\n");
+
+	for (i = 0; i < 2; i++) {
+		struct replay_stream *r = &streams[i];
+		double audio_s = (double)r->frames / sample_rate;
+
+		if (!r->seen)
+			continue;
+		// Rates are per second of replayed audio, not of wall time
+		r->s.start_ns = now_ns() - (uint64_t)(audio_s * 1e9);
+		qubes_jack_stream_print_stats(&r->s, stderr);
+		fprintf(stderr, "%s: %.3f s of audio in %.3f ms, %.1f ns/frame, %.0fx realtime\n",
+			names[i], audio_s, r->busy_ns / 1e6,
+			r->frames ? (double)r->busy_ns / r->frames : 0.,
+			r->busy_ns ? audio_s * 1e9 / r->busy_ns : 0.);
+		if (r->out)
+			fclose(r->out);
+		qubes_jack_stream_destroy(&r->s);
+		qubes_jack_chan_close(r->ring);
+		free(r->data);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "qubes-vchan-jack-route.h"
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+/*
+ * The mix kernels, four lanes at a time like the meter.  Loads and stores
+ * go through memcpy, so JACK buffers needn't be aligned.
+ */
+static void mix_set(float *out, const float *in, float gain, uint32_t n)
+{
+	const v4sf g = { gain, gain, gain, gain };
+	uint32_t i = 0;
+	v4sf x;
+
+	for (; i + 4 <= n; i += 4) {
+		memcpy(&x, in + i, sizeof(x));
+		x *= g;
+		memcpy(out + i, &x, sizeof(x));
+	}
+	for (; i < n; i++)
+		out[i] = in[i] * gain;
+}
+
+static void mix_add(float *out, const float *in, float gain, uint32_t n)
+{
+	const v4sf g = { gain, gain, gain, gain };
+	uint32_t i = 0;
+	v4sf x, y;
+
+	for (; i + 4 <= n; i += 4) {
+		memcpy(&x, in + i, sizeof(x));
+		memcpy(&y, out + i, sizeof(y));
+		y += x * g;
+		memcpy(out + i, &y, sizeof(y));
+	}
+	for (; i < n; i++)
+		out[i] += in[i] * gain;
+}
+
+// RT safe.  src and dst must not share buffers.
+void qubes_jack_route_run(const struct qubes_jack_route *r, float **src,
+			  float **dst, uint32_t nframes)
+{
+	const struct qubes_jack_route_entry *e = r->entry;
+	const struct qubes_jack_route_entry *end = r->entry + r->count;
+	unsigned int d;
+
+	for (d = 0; d < r->dests; d++) {
+		if (e == end || e->dst != d) {
+			memset(dst[d], 0, nframes * sizeof(float));
+			continue;
+		}
+		mix_set(dst[d], src[e->src], e->gain, nframes);
+		for (e++; e != end && e->dst == d; e++)
+			mix_add(dst[d], src[e->src], e->gain, nframes);
+	}
+}
+
+// Insert keeping the entries sorted by destination, then source
+static int route_add(struct qubes_jack_route *r, unsigned int src,
+		     unsigned int dst, float gain)
+{
+	unsigned int i = r->count;
+
+	while (i > 0 && (r->entry[i - 1].dst > dst ||
+			 (r->entry[i - 1].dst == dst && r->entry[i - 1].src > src)))
+		i--;
+	if (i > 0 && r->entry[i - 1].dst == dst && r->entry[i - 1].src == src)
+		return -1;
+
+	memmove(r->entry + i + 1, r->entry + i,
+		(r->count - i) * sizeof(r->entry[0]));
+	r->entry[i].src = src;
+	r->entry[i].dst = dst;
+	r->entry[i].gain = gain;
+	r->count++;
+	return 0;
+}
+
+/*
+ * Give the AppVM n channels.  With fewer channels than ports each one is
+ * spread over every port that matches it modulo n, so stereo fills left
+ * and right on all eight outputs.  With more, they are folded onto the
+ * ports modulo the port count and averaged, so 8 channels come down to
+ * stereo without clipping.
+ */
+static void route_mix(struct qubes_jack_route *r, unsigned int n,
+		      unsigned int ports, bool playback)
+{
+	unsigned int s, d, k;
+
+	r->sources = playback ? n : ports;
+	r->dests = playback ? ports : n;
+
+	for (d = 0; d < r->dests; d++) {
+		k = 0;
+		for (s = 0; s < r->sources; s++)
+			if (r->sources > r->dests ? s % r->dests == d :
+			    d % r->sources == s)
+				k++;
+		for (s = 0; s < r->sources; s++)
+			if (r->sources > r->dests ? s % r->dests == d :
+			    d % r->sources == s)
+				route_add(r, s, d, 1.f / k);
+	}
+}
+
+/*
+ * "src>dst[*gain],...", channels counted from 1.  The AppVM gets as many
+ * channels as the highest one named on its side.  Entries for ports that
+ * aren't there are dropped, so they come back with the ports.
+ */
+static int route_parse(struct qubes_jack_route *r, const char *spec,
+		       unsigned int ports, bool playback)
+{
+	const char *p = spec;
+	unsigned int n = 0, i, j;
+	long s, d;
+	float g;
+	char *end;
+
+	while (*p) {
+		s = strtol(p, &end, 10);
+		if (end == p || *end != '>')
+			return -1;
+		p = end + 1;
+		d = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		g = 1.f;
+		if (*p == '*') {
+			// Routes can come from the AppVM: no NaN, inf or
+			// anything that would blow up the SoundVM's graph
+			g = strtof(p + 1, &end);
+			if (end == p + 1 || !isfinite(g))
+				return -1;
+			g = fmaxf(-QUBES_JACK_ROUTE_MAX_GAIN,
+				  fminf(g, QUBES_JACK_ROUTE_MAX_GAIN));
+			p = end;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+
+		if (s < 1 || s > MAX_CH || d < 1 || d > MAX_CH)
+			return -1;
+		if (route_add(r, s - 1, d - 1, g))
+			return -1;
+		if ((unsigned int)(playback ? s : d) > n)
+			n = playback ? s : d;
+	}
+
+	r->sources = playback ? n : ports;
+	r->dests = playback ? ports : n;
+	for (i = 0, j = 0; i < r->count; i++)
+		if (r->entry[i].src < r->sources && r->entry[i].dst < r->dests)
+			r->entry[j++] = r->entry[i];
+	r->count = j;
+	return 0;
+}
+
+/*
+ * Build the route for spec against the ports we have now: "identity" (or
+ * empty) for one AppVM channel per port, "stereo", "mix:<n>" or an
+ * explicit list.  No ports, no channels.  Not RT safe.
+ */
+int qubes_jack_route_build(struct qubes_jack_route *r, const char *spec,
+			   unsigned int ports, bool playback)
+{
+	unsigned int i;
+	char *end;
+	long n;
+	int ret = 0;
+
+	memset(r, 0, sizeof(*r));
+
+	if (!spec || !*spec || !strcmp(spec, "identity")) {
+		n = ports;
+	} else if (!strcmp(spec, "stereo")) {
+		n = 2;
+	} else if (!strncmp(spec, "mix:", 4)) {
+		n = strtol(spec + 4, &end, 10);
+		if (end == spec + 4 || *end || n < 1 || n > MAX_CH)
+			return -1;
+	} else {
+		ret = route_parse(r, spec, ports, playback);
+		n = -1;
+	}
+
+	if (ret || !ports) {
+		memset(r, 0, sizeof(*r));
+		return ret;
+	}
+	if (n >= 0)
+		route_mix(r, n, ports, playback);
+
+	r->identity = r->sources == r->dests && r->count == r->sources;
+	for (i = 0; i < r->count; i++)
+		if (r->entry[i].src != r->entry[i].dst || r->entry[i].gain != 1.f)
+			r->identity = false;
+	return 0;
+}
+
+void qubes_jack_route_print(const struct qubes_jack_route *r,
+			    const char *name, FILE *f)
+{
+	unsigned int i;
+
+	if (r->identity) {
+		fprintf(f, "%s: identity, %u channels\n", name, r->sources);
+		return;
+	}
+
+	fprintf(f, "%s: %u -> %u channels:", name, r->sources, r->dests);
+	for (i = 0; i < r->count; i++) {
+		fprintf(f, " %u>%u", r->entry[i].src + 1, r->entry[i].dst + 1);
+		if (r->entry[i].gain != 1.f)
+			fprintf(f, "*%.3g", r->entry[i].gain);
+	}
+	fprintf(f, "\n");
+}
@@ -0,0 +1,69 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#ifndef QUBES_VCHAN_JACK_ROUTE_H
+#define QUBES_VCHAN_JACK_ROUTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "qubes-vchan-jack.h"
+
+#define QUBES_JACK_MAX_ROUTES (MAX_CH * MAX_CH)
+#define QUBES_JACK_ROUTE_SPEC_MAX 256
+// Gains are clamped to +/- this, about +24 dB
+#define QUBES_JACK_ROUTE_MAX_GAIN 16.f
+
+// Directions, as in QUBES_JACK_TLV_ROUTE
+#define QUBES_JACK_ROUTE_PLAY 0
+#define QUBES_JACK_ROUTE_REC 1
+
+struct qubes_jack_route_entry {
+	uint8_t src;
+	uint8_t dst;
+	float gain;
+};
+
+/*
+ * A sparse gain matrix from sources channels to dests channels, with the
+ * entries sorted by destination so that each output is written once and
+ * then added to.  On playback the sources are the AppVM's channels and
+ * the destinations our ports; on record it is the other way round.
+ */
+struct qubes_jack_route {
+	unsigned int sources;
+	unsigned int dests;
+	unsigned int count;
+	bool identity;			// one to one, nothing to mix
+	struct qubes_jack_route_entry entry[QUBES_JACK_MAX_ROUTES];
+};
+
+int qubes_jack_route_build(struct qubes_jack_route *r, const char *spec,
+			   unsigned int ports, bool playback);
+void qubes_jack_route_run(const struct qubes_jack_route *r, float **src,
+			  float **dst, uint32_t nframes);
+void qubes_jack_route_print(const struct qubes_jack_route *r,
+			    const char *name, FILE *f);
+
+#endif
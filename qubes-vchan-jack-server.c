@@ -34,15 +34,24 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h> // ceilf()
+#include <inttypes.h>
+#include <signal.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "qubes-vchan-jack.h"
-#include <libvchan.h>
+#include "qubes-vchan-jack-stream.h"
+#include "qubes-vchan-jack-control.h"
+#include "qubes-vchan-jack-capture.h"
+#include "qubes-vchan-jack-meter.h"
+#include "qubes-vchan-jack-route.h"
+#include "qubes-vchan-jack-transport.h"
+#include "qubes-vchan-jack-trace.h"
 
 #include <jack/jack.h>
+#include <jack/thread.h>
 #include <jack/statistics.h>
 
 struct userdata {
@@ -50,22 +59,176 @@ struct userdata {
 	unsigned int jack_buffer_size;
 	unsigned int jack_xruns;
 	unsigned int jack_latency;
+	unsigned int xrun_total;
 
 	jack_client_t *jack_client;
 	jack_port_t *input_ports[MAX_CH];
 	jack_port_t *output_ports[MAX_CH];
 
-	libvchan_t *control;
-	libvchan_t *play;
-	libvchan_t *rec;
+	struct qubes_jack_chan *control;
+	struct qubes_jack_chan *play;
+	struct qubes_jack_chan *rec;
+
+	struct qubes_jack_stream play_stream;
+	struct qubes_jack_stream rec_stream;
+	struct qubes_jack_ctrl ctrl;
 
 	char *tmpbuffer;
+	float *mixbuf;			// client's channels either side of a route
+	uint32_t scratch_frames;	// period tmpbuffer is sized for
+	unsigned int peer_buffer_size;	// client's JACK period, 0: not told
+	unsigned int ring_frames;	// per data ring, of MAX_CH audio
 	uint8_t play_count;
 	uint8_t record_count;
 	bool ports_ready;
 	bool pause;
+	volatile unsigned int dirs;	// QUBES_JACK_DIR_* the client uses
+	volatile unsigned int held;	// QUBES_JACK_DIR_* waiting for PORTS
+	uint64_t held_ns;
+	bool peer_freewheeling;
+	int play_policy;		// -p, put back once the client stops
+					// freewheeling
+
+	struct qubes_jack_rt_sync rt;
+	int notify;			// NOTIFY_* bits, set from JACK callbacks
+
+	int domid;
+	volatile bool link_up;		// vchans may be touched by the RT thread
+	bool awaiting_audio;
+	uint64_t lost_ns;		// when the peer went away
+	volatile uint64_t resume_ns;	// when the RT thread saw it come back
+	unsigned int reconnects;
+	uint64_t last_ttfa_ns;
+
+	unsigned int batch;		// periods per transfer, 1: low latency
+
+	unsigned int meter_ms;		// 0: metering off
+	struct qubes_jack_meter play_meter;
+	struct qubes_jack_meter rec_meter;
+	uint32_t play_meter_seq;
+	uint32_t rec_meter_seq;
+	struct qubes_jack_meter_values play_levels;
+	struct qubes_jack_meter_values rec_levels;
+
+	unsigned int max_channels;	// per direction, at most MAX_CH
+	struct qubes_jack_hist cb_hist;
+
+	unsigned int qos;		// index into qos_classes
+	uint64_t qos_shed;		// cycles whose transfers were skipped
+	uint64_t qos_misses;		// cycles that finished past the class deadline
+
+	/*
+	 * Routing between the client's channels and our ports, per
+	 * QUBES_JACK_ROUTE_* direction.  The control thread builds a new
+	 * route in the slot the process callback isn't using and swaps it in.
+	 */
+	char route_spec[2][QUBES_JACK_ROUTE_SPEC_MAX];
+	struct qubes_jack_route routes[2][2];
+	struct qubes_jack_route *route[2];
+	bool route_updates;		// the client may change routes
+
+	const struct qubes_jack_transport *transport;
+};
+
+/*
+ * Several AppVMs share the SoundVM's jackd, one server per VM.  A server's
+ * class says how much of the JACK period it may use: past shed_pct at the
+ * start of our callback the transfers are skipped and silence played, and
+ * finishing past deadline_pct counts as a miss.  Best-effort servers also
+ * run their process thread below jackd's client priority, so where jackd
+ * runs clients in parallel they are the ones that wait.
+ */
+struct qos_class {
+	const char *name;
+	unsigned int shed_pct;		// 0: never shed
+	unsigned int deadline_pct;
+	int prio_offset;
 };
 
+static const struct qos_class qos_classes[] = {
+	{ "realtime", 0, 100, 0 },
+	{ "normal", 75, 90, 0 },
+	{ "best-effort", 50, 75, -5 },
+};
+
+#define QOS_DEFAULT 1
+
+struct cycle_budget {
+	bool valid;
+	jack_time_t start;
+	float period;			// usecs
+};
+
+#define NOTIFY_BUFFER_SIZE (1 << 0)
+#define NOTIFY_SAMPLE_RATE (1 << 1)
+#define NOTIFY_PORTS (1 << 2)
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t dump_stats;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p policy] [-r policy] [-l frames] [-t transport] [-w file [-W MiB]] [-T file] [-b periods] [-m ms] [-n channels] [-q class] [-o route] [-i route] [-R] <domid>\n", prog);
+	fprintf(stderr, "  -p  playback underflow policy\n");
+	fprintf(stderr, "  -r  record overflow policy\n");
+	fprintf(stderr, "      drop-newest (default), drop-oldest or block[:timeout_ms]\n");
+	fprintf(stderr, "  -l  frames queued beyond a period before latency is trimmed\n");
+	fprintf(stderr, "  -t  transport: vchan (default) or memfd for same-host peers\n");
+	fprintf(stderr, "  -w  capture streams and control traffic to a file\n");
+	fprintf(stderr, "  -W  capture file size in MiB (default %d)\n",
+		QUBES_JACK_CAPTURE_DEFAULT_MB);
+	fprintf(stderr, "  -T  write a Chrome/Perfetto trace of every cycle to a file\n");
+	fprintf(stderr, "  -b  throughput profile: periods per transfer (1-%d, default 1)\n",
+		QUBES_JACK_MAX_BATCH);
+	fprintf(stderr, "  -m  meter peak/RMS levels over windows of this many ms\n");
+	fprintf(stderr, "  -n  use at most this many channels per direction (default %d)\n",
+		MAX_CH);
+	fprintf(stderr, "  -q  QoS class: realtime, normal (default) or best-effort\n");
+	fprintf(stderr, "  -o  playback route onto our outputs, -i record route from our inputs:\n");
+	fprintf(stderr, "      identity (default), stereo, mix:<channels> or src>dst[*gain],...\n");
+	fprintf(stderr, "  -R  let the client change routes over the control channel\n");
+}
+
+static void handle_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		dump_stats = 1;
+	else
+		quit = 1;
+}
+
+static void print_stats(struct userdata *u)
+{
+	fprintf(stderr, "xruns: %u, reconnects: %u, last time to first audio: %"
+		PRIu64 " us\n", u->xrun_total, u->reconnects,
+		u->last_ttfa_ns / 1000);
+	fprintf(stderr, "period: %u frames, client %u frames, rings %u frames\n",
+		u->jack_buffer_size, u->peer_buffer_size, u->ring_frames);
+	fprintf(stderr, "directions: %s\n", qubes_jack_dirs_name(u->dirs));
+	qubes_jack_route_print(u->route[QUBES_JACK_ROUTE_PLAY], "playback route",
+			       stderr);
+	qubes_jack_route_print(u->route[QUBES_JACK_ROUTE_REC], "record route",
+			       stderr);
+	qubes_jack_hist_print(&u->cb_hist, stderr);
+	fprintf(stderr, "qos: class %s, shed cycles %" PRIu64
+		", deadline misses %" PRIu64 "\n", qos_classes[u->qos].name,
+		u->qos_shed, u->qos_misses);
+	qubes_jack_stream_print_stats(&u->play_stream, stderr);
+	qubes_jack_stream_print_stats(&u->rec_stream, stderr);
+	qubes_jack_meter_print(&u->play_levels, "playback meter", stderr);
+	qubes_jack_meter_print(&u->rec_levels, "record meter", stderr);
+	qubes_jack_ctrl_print(&u->ctrl, stderr);
+}
+
+// Channels we may use towards physical ports with these flags
+static unsigned int channel_limit(struct userdata *u, unsigned long flags)
+{
+	unsigned int dir = flags & JackPortIsInput ?
+		QUBES_JACK_DIR_PLAY : QUBES_JACK_DIR_REC;
+
+	return u->dirs & dir ? u->max_channels : 0;
+}
+
 static void qubes_jack_connect_ports(struct userdata *u)
 {
 	unsigned int c;
@@ -85,7 +248,8 @@ static void qubes_jack_connect_ports(struct userdata *u)
 	}
 
 	// Connect outputs to playback
-	for (c = 0; c < MAX_CH && phys_in_ports[c] != NULL; c++) {
+	for (c = 0; c < channel_limit(u, JackPortIsInput) &&
+			phys_in_ports[c] != NULL; c++) {
 		const char *src_port = jack_port_name(u->output_ports[c]);
 		jack_connect(u->jack_client, src_port, phys_in_ports[c]);
 	}
@@ -97,7 +261,8 @@ skipplayback:
 	}
 
 	// Connect inputs to capture
-	for (c = 0; c < MAX_CH && phys_out_ports[c] != NULL; c++) {
+	for (c = 0; c < channel_limit(u, JackPortIsOutput) &&
+			phys_out_ports[c] != NULL; c++) {
 		const char *src_port = jack_port_name(u->input_ports[c]);
 		jack_connect(u->jack_client, phys_out_ports[c], src_port);
 	}
@@ -108,44 +273,61 @@ end:
 	jack_free(phys_in_ports);
 }
 
-static void get_jack_play_port_count(struct userdata *u)
+static unsigned int count_physical_ports(struct userdata *u, unsigned long flags)
 {
-	unsigned int c;
-	u->play_count = 0;
+	unsigned int c = 0;
 
-	const char **phys_in_ports = jack_get_ports(u->jack_client,
-							  NULL, NULL,
-							  JackPortIsInput
-							  | JackPortIsPhysical);
-	if (*phys_in_ports == NULL)
-		goto end;
+	const char **ports = jack_get_ports(u->jack_client, NULL, NULL,
+					    flags | JackPortIsPhysical);
+	if (ports == NULL)
+		return 0;
 
-	// Count playback ports
-	for (c = 0; c < MAX_CH && phys_in_ports[c] != NULL; c++) {}
-	u->play_count = c;
+	for (c = 0; c < channel_limit(u, flags) && ports[c] != NULL; c++) {}
 
-end:
-	jack_free(phys_in_ports);
+	jack_free(ports);
+	return c;
 }
 
-static void get_jack_rec_port_count(struct userdata *u)
+static void open_jack_ports(struct userdata *u)
 {
 	unsigned int c;
-	u->record_count = 0;
 
-	const char **phys_out_ports = jack_get_ports(u->jack_client,
-							  NULL, NULL,
-							  JackPortIsOutput
-							  | JackPortIsPhysical);
-	if (*phys_out_ports == NULL)
-		goto end;
+	for (c = 0; c < u->play_count; c++) {
+		char portname[20];
+		snprintf(portname, 20, "out_%d", c);
+		u->output_ports[c] = jack_port_register(u->jack_client,
+					portname,
+					JACK_DEFAULT_AUDIO_TYPE,
+					JackPortIsOutput, 0);
+	}
 
-	// Count capture ports
-	for (c = 0; c < MAX_CH && phys_out_ports[c] != NULL; c++) {}
-	u->record_count = c;
+	for (c = 0; c < u->record_count; c++) {
+		char portname[20];
+		snprintf(portname, 20, "in_%d", c);
+		u->input_ports[c] = jack_port_register(u->jack_client,
+					portname,
+					JACK_DEFAULT_AUDIO_TYPE,
+					JackPortIsInput, 0);
+	}
+}
 
-end:
-	jack_free(phys_out_ports);
+static void close_jack_ports(struct userdata *u)
+{
+	unsigned int c;
+
+	for (c = 0; c < u->play_count; c++) {
+		if (u->output_ports[c]) {
+			jack_port_unregister(u->jack_client, u->output_ports[c]);
+			u->output_ports[c] = NULL;
+		}
+	}
+
+	for (c = 0; c < u->record_count; c++) {
+		if (u->input_ports[c]) {
+			jack_port_unregister(u->jack_client, u->input_ports[c]);
+			u->input_ports[c] = NULL;
+		}
+	}
 }
 
 static int qubes_jack_xrun_callback(void *arg)
@@ -156,9 +338,93 @@ static int qubes_jack_xrun_callback(void *arg)
 	int fragments = (int)ceilf( ((delay / 1000000.0) * u->jack_sample_rate )
 				   / (float)(u->jack_buffer_size) );
 	u->jack_xruns += fragments;
+	u->xrun_total += fragments;
+	qubes_jack_trace_instant("xrun", NULL, fragments);
 	return 0;
 }
 
+/*
+ * Size the scratch and staging buffers for periods of frames frames.  A
+ * stream that can't be resized keeps its old size and drops longer
+ * periods, so tmpbuffer is kept at least as big as either stream's.
+ */
+static int resize_buffers(struct userdata *u, uint32_t frames)
+{
+	char *buf;
+	float *mix;
+	int ret;
+
+	if (frames == u->scratch_frames)
+		return 0;
+
+	buf = frames <= MAX_JACK_BUFFER ?
+		malloc(QUBES_JACK_SCRATCH_BYTES(frames)) : NULL;
+	mix = buf ? malloc(QUBES_JACK_SCRATCH_BYTES(frames)) : NULL;
+	if (!mix) {
+		free(buf);
+		fprintf(stderr, "Can't resize buffers for %u frame periods\n",
+			frames);
+		return -1;
+	}
+
+	ret = qubes_jack_stream_set_period(&u->play_stream, frames);
+	ret |= qubes_jack_stream_set_period(&u->rec_stream, frames);
+	if (ret)
+		fprintf(stderr, "Can't resize buffers for %u frame periods\n",
+			frames);
+
+	if (ret && frames < u->scratch_frames) {
+		free(buf);
+		free(mix);
+	} else {
+		free(u->tmpbuffer);
+		free(u->mixbuf);
+		u->tmpbuffer = buf;
+		u->mixbuf = mix;
+		u->scratch_frames = frames;
+	}
+	return ret;
+}
+
+/*
+ * JACK calls this from its notification thread with the graph stopped,
+ * before the first cycle of the new size, so the buffers can be swapped
+ * here without waiting the process callback out.  The control thread
+ * then tells the client, and relinks if the rings are now too small.
+ */
+static int qubes_jack_buffer_size_callback(jack_nframes_t nframes, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	resize_buffers(u, nframes);
+	u->jack_buffer_size = nframes;
+	__atomic_or_fetch(&u->notify, NOTIFY_BUFFER_SIZE, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int qubes_jack_sample_rate_callback(jack_nframes_t nframes, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	u->jack_sample_rate = nframes;
+	u->play_stream.sample_rate = nframes;
+	u->rec_stream.sample_rate = nframes;
+	qubes_jack_meter_set_rate(&u->play_meter, nframes, u->meter_ms);
+	qubes_jack_meter_set_rate(&u->rec_meter, nframes, u->meter_ms);
+	__atomic_or_fetch(&u->notify, NOTIFY_SAMPLE_RATE, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static void qubes_jack_port_registration_callback(jack_port_id_t port,
+						  int reg, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	(void)port;
+	(void)reg;
+	__atomic_or_fetch(&u->notify, NOTIFY_PORTS, __ATOMIC_SEQ_CST);
+}
+
 static int qubes_jack_graph_order_callback(void *arg)
 {
 	struct userdata *u = (struct userdata *)arg;
@@ -187,56 +453,456 @@ static int qubes_jack_graph_order_callback(void *arg)
 	return 0;
 }
 
+// Channels the client sees, which the routes decide
+static uint8_t client_channels(struct userdata *u, unsigned int dir)
+{
+	return dir == QUBES_JACK_ROUTE_PLAY ? u->route[dir]->sources :
+		u->route[dir]->dests;
+}
+
 static void send_config_data(struct userdata *u)
 {
 	uint8_t response[QUBES_JACK_CONFIG_QUERY_SIZE];
 
 	// Prepare the response packet
 	response[0] = QUBES_JACK_CONFIG_QUERY_START;
-	response[1] = u->play_count;
-	response[2] = u->record_count;
+	response[1] = client_channels(u, QUBES_JACK_ROUTE_PLAY);
+	response[2] = client_channels(u, QUBES_JACK_ROUTE_REC);
 	response[3] = log2_(u->jack_buffer_size);
 	write_nth_u32(response, 1, u->jack_sample_rate);
 	write_nth_u32(response, 2, u->jack_xruns);
 	response[12] = QUBES_JACK_CONFIG_QUERY_END;
 
 	// Write response to vchan
-	if (libvchan_buffer_space(u->control) >= QUBES_JACK_CONFIG_QUERY_SIZE) {
-		libvchan_write(u->control, response, QUBES_JACK_CONFIG_QUERY_SIZE);
+	if (qubes_jack_chan_buffer_space(u->control) >= QUBES_JACK_CONFIG_QUERY_SIZE) {
+		qubes_jack_chan_write(u->control, response, QUBES_JACK_CONFIG_QUERY_SIZE);
 	}
 }
 
-static void process_vchan_client_query(struct userdata *u)
+static void send_config_v2(struct userdata *u)
+{
+	uint8_t buf[3 * sizeof(uint32_t)];
+
+	buf[0] = client_channels(u, QUBES_JACK_ROUTE_PLAY);
+	buf[1] = client_channels(u, QUBES_JACK_ROUTE_REC);
+	buf[2] = log2_(u->jack_buffer_size);
+	buf[3] = 0;
+	write_nth_u32(buf, 1, u->jack_sample_rate);
+	write_nth_u32(buf, 2, u->jack_xruns);
+	qubes_jack_ctrl_send(&u->ctrl, QUBES_JACK_TLV_CONFIG, buf, sizeof(buf));
+}
+
+static void send_ports(struct userdata *u)
+{
+	uint8_t buf[sizeof(uint32_t)];
+
+	buf[0] = client_channels(u, QUBES_JACK_ROUTE_PLAY);
+	buf[1] = client_channels(u, QUBES_JACK_ROUTE_REC);
+	buf[2] = 0;
+	buf[3] = 0;
+	qubes_jack_ctrl_send(&u->ctrl, QUBES_JACK_TLV_PORTS, buf, sizeof(buf));
+}
+
+/*
+ * Rebuild both routes for the current specs and ports and swap them in.
+ * The process callback picks its routes up once per cycle, so once the
+ * callback in flight is done the old slots are free for the next rebuild.
+ */
+static void apply_routes(struct userdata *u)
+{
+	struct qubes_jack_route *next;
+	unsigned int dir;
+
+	for (dir = 0; dir < 2; dir++) {
+		next = u->route[dir] == &u->routes[dir][0] ?
+			&u->routes[dir][1] : &u->routes[dir][0];
+		// Specs are checked before they are stored
+		qubes_jack_route_build(next, u->route_spec[dir],
+				       dir == QUBES_JACK_ROUTE_PLAY ?
+				       u->play_count : u->record_count,
+				       dir == QUBES_JACK_ROUTE_PLAY);
+		__atomic_store_n(&u->route[dir], next, __ATOMIC_RELEASE);
+	}
+	qubes_jack_rt_sync(&u->rt);
+}
+
+/*
+ * The client's channel counts are changing.  Frames already queued are in
+ * the old width, and with an odd width what is left over isn't a whole
+ * number of new frames, so hold each direction whose count changes until
+ * the client echoes the new counts.  A v1 client can't be told anyway.
+ */
+static void hold_channels(struct userdata *u, unsigned int dirs)
+{
+	if (!dirs || u->ctrl.version < 2)
+		return;
+	__atomic_or_fetch(&u->held, dirs, __ATOMIC_SEQ_CST);
+	u->held_ns = now_ns();
+	qubes_jack_rt_sync(&u->rt);
+}
+
+// Start the held directions again from empty rings
+static void release_channels(struct userdata *u)
+{
+	unsigned int dirs = u->held;
+
+	if (dirs & QUBES_JACK_DIR_PLAY)
+		qubes_jack_stream_flush(&u->play_stream);
+	if (dirs & QUBES_JACK_DIR_REC)
+		qubes_jack_stream_flush(&u->rec_stream);
+	__atomic_and_fetch(&u->held, ~dirs, __ATOMIC_SEQ_CST);
+}
+
+// A client that predates the echo gets its directions back after a while
+static void check_held(struct userdata *u)
+{
+	if (u->held &&
+	    now_ns() - u->held_ns > QUBES_JACK_PORTS_ACK_MS * 1000000ULL) {
+		fprintf(stderr, "Client didn't confirm its channels, resuming\n");
+		release_channels(u);
+	}
+}
+
+/*
+ * Physical ports came or went, or the client changed directions: rewire to
+ * the new set and tell the client how many channels to expect now.
+ */
+static void handle_port_change(struct userdata *u)
+{
+	uint8_t play_count = count_physical_ports(u, JackPortIsInput);
+	uint8_t record_count = count_physical_ports(u, JackPortIsOutput);
+	uint8_t play = client_channels(u, QUBES_JACK_ROUTE_PLAY);
+	uint8_t rec = client_channels(u, QUBES_JACK_ROUTE_REC);
+	unsigned int changed = 0;
+	uint64_t t;
+
+	if (play_count == u->play_count && record_count == u->record_count)
+		return;
+
+	// Keep the process callback off the port arrays while they change
+	t = qubes_jack_trace_begin();
+	u->ports_ready = false;
+	qubes_jack_rt_sync(&u->rt);
+
+	close_jack_ports(u);
+	u->play_count = play_count;
+	u->record_count = record_count;
+	open_jack_ports(u);
+	qubes_jack_connect_ports(u);
+	apply_routes(u);
+
+	if (play != client_channels(u, QUBES_JACK_ROUTE_PLAY))
+		changed |= QUBES_JACK_DIR_PLAY;
+	if (rec != client_channels(u, QUBES_JACK_ROUTE_REC))
+		changed |= QUBES_JACK_DIR_REC;
+	hold_channels(u, changed);
+
+	u->ports_ready = true;
+	qubes_jack_trace_end(t, "reconfigure", "ports",
+			     play_count << 8 | record_count);
+	if (u->ctrl.version >= 2)
+		send_ports(u);
+}
+
+/*
+ * Serve only the directions the client uses: keep the process callback off
+ * the other vchan, close it and drop its ports.  A direction whose vchan
+ * is already closed can't come back before the next relink.
+ */
+static unsigned int set_directions(struct userdata *u, unsigned int dirs)
+{
+	if (!u->play)
+		dirs &= ~QUBES_JACK_DIR_PLAY;
+	if (!u->rec)
+		dirs &= ~QUBES_JACK_DIR_REC;
+
+	if (dirs != u->dirs) {
+		u->dirs = dirs;
+		qubes_jack_rt_sync(&u->rt);
+	}
+
+	if (!(dirs & QUBES_JACK_DIR_PLAY) && u->play) {
+		qubes_jack_chan_close(u->play);
+		u->play = NULL;
+	}
+	if (!(dirs & QUBES_JACK_DIR_REC) && u->rec) {
+		qubes_jack_chan_close(u->rec);
+		u->rec = NULL;
+	}
+
+	handle_port_change(u);
+	return dirs;
+}
+
+/*
+ * A new route from the client.  Only the server's own mix changes, the
+ * JACK graph stays as it is; the client is told if its channel count does.
+ */
+static void handle_route(struct userdata *u, const struct qubes_jack_msg *msg)
+{
+	struct qubes_jack_route check;
+	char spec[QUBES_JACK_ROUTE_SPEC_MAX];
+	unsigned int dir, len, ports;
+	bool changed;
+
+	if (msg->len < sizeof(uint32_t) || msg->val[0] > QUBES_JACK_ROUTE_REC)
+		return;
+	dir = msg->val[0];
+	if (!u->route_updates) {
+		fprintf(stderr, "Ignoring route from client, start with -R to allow it\n");
+		return;
+	}
+
+	len = msg->len - sizeof(uint32_t);
+	if (len >= sizeof(spec))
+		return;
+	memcpy(spec, msg->val + sizeof(uint32_t), len);
+	spec[len] = '\0';
+	if (qubes_jack_route_build(&check, spec, MAX_CH,
+				   dir == QUBES_JACK_ROUTE_PLAY)) {
+		fprintf(stderr, "Bad route from client: %s\n", spec);
+		return;
+	}
+
+	// Hold the direction before its width changes under the client
+	ports = dir == QUBES_JACK_ROUTE_PLAY ? u->play_count : u->record_count;
+	qubes_jack_route_build(&check, spec, ports, dir == QUBES_JACK_ROUTE_PLAY);
+	changed = (dir == QUBES_JACK_ROUTE_PLAY ? check.sources : check.dests) !=
+		client_channels(u, dir);
+	if (changed)
+		hold_channels(u, dir == QUBES_JACK_ROUTE_PLAY ?
+			      QUBES_JACK_DIR_PLAY : QUBES_JACK_DIR_REC);
+
+	strcpy(u->route_spec[dir], spec);
+	apply_routes(u);
+	if (changed)
+		send_ports(u);
+}
+
+/*
+ * A freewheeling client relies on us to take every period it sends, so
+ * keep whatever it has queued rather than trimming it.  Our RT thread
+ * serves every VM on this jackd and must never wait on one, so playback
+ * runs drop-newest meanwhile: a client slower than realtime underruns,
+ * one faster fills its ring and blocks on its own side.
+ */
+static void set_peer_freewheel(struct userdata *u, bool on)
+{
+	struct qubes_jack_stream *s = &u->play_stream;
+
+	if (on == u->peer_freewheeling)
+		return;
+	u->peer_freewheeling = on;
+
+	if (on) {
+		u->play_policy = s->policy;
+		s->policy = QUBES_JACK_POLICY_DROP_NEWEST;
+		s->keep_backlog = true;
+	} else {
+		s->keep_backlog = false;
+		s->policy = u->play_policy;
+	}
+	fprintf(stderr, "Client %s freewheeling\n", on ? "started" : "stopped");
+}
+
+/*
+ * A clocked client blocks on every record period, so batching record
+ * would stall it between batches until its wait timed out.  Keep record
+ * unbatched for it; playback stays batched.
+ */
+static void set_peer_clocked(struct userdata *u, bool clocked)
 {
-	uint8_t cmd;
+	unsigned int batch = clocked ? 1 : u->batch;
+
+	if (batch == u->rec_stream.batch)
+		return;
+
+	u->ports_ready = false;
+	qubes_jack_rt_sync(&u->rt);
+	if (qubes_jack_stream_set_batch(&u->rec_stream, batch))
+		fprintf(stderr, "Can't batch %u periods per transfer\n", batch);
+	u->ports_ready = true;
+	qubes_jack_capture_info(QUBES_JACK_CAP_ROLE_SERVER, u->jack_sample_rate,
+				u->play_stream.batch, u->rec_stream.batch);
+}
 
-	if (libvchan_data_ready(u->control) >= 1) {
-		libvchan_read(u->control, &cmd, 1);
-		if (cmd == QUBES_JACK_CONFIG_QUERY_CMD) {
+static void process_vchan_client_query(struct userdata *u)
+{
+	struct qubes_jack_msg msg;
+	unsigned int dirs;
+
+	while (qubes_jack_ctrl_recv(&u->ctrl, &msg)) {
+		if (qubes_jack_ctrl_handle_common(&u->ctrl, &msg))
+			continue;
+
+		switch (msg.type) {
+		case QUBES_JACK_MSG_V1_QUERY:
+			/*
+			 * A client whose HELLO reply was slow falls back to
+			 * the v1 query too.  It takes our HELLO when it comes,
+			 * so stay on v2.
+			 */
+			if (u->ctrl.version >= 2)
+				break;
+			u->ctrl.version = 1;
+			set_peer_freewheel(u, false);
+			set_directions(u, QUBES_JACK_DIR_DUPLEX);
 			send_config_data(u);
+			break;
+		case QUBES_JACK_TLV_HELLO:
+			// A new session, the client says if it freewheels or
+			// is clocked
+			set_peer_freewheel(u, false);
+			set_peer_clocked(u, false);
+			// Before the version, so the counts go out in CONFIG
+			dirs = set_directions(u, qubes_jack_hello_dirs(&msg));
+			u->ctrl.version = QUBES_JACK_CONTROL_VERSION;
+			qubes_jack_ctrl_send_hello(&u->ctrl, dirs);
+			send_config_v2(u);
+			// CONFIG only carries log2 of the period
+			qubes_jack_ctrl_send_u32(&u->ctrl,
+						 QUBES_JACK_TLV_BUFFER_SIZE,
+						 u->jack_buffer_size);
+			// Even 1, the client may still batch for our last run
+			qubes_jack_ctrl_send_u32(&u->ctrl, QUBES_JACK_TLV_BATCH,
+						 u->batch);
+			break;
+		case QUBES_JACK_TLV_BUFFER_SIZE:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			u->peer_buffer_size = read_nth_u32(msg.val, 0);
+			break;
+		case QUBES_JACK_TLV_ROUTE:
+			handle_route(u, &msg);
+			break;
+		case QUBES_JACK_TLV_PORTS:
+			// The client has caught up with the counts we sent
+			if (msg.len >= sizeof(uint32_t) &&
+			    msg.val[0] == client_channels(u, QUBES_JACK_ROUTE_PLAY) &&
+			    msg.val[1] == client_channels(u, QUBES_JACK_ROUTE_REC))
+				release_channels(u);
+			break;
+		case QUBES_JACK_TLV_FREEWHEEL:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			set_peer_freewheel(u, read_nth_u32(msg.val, 0) != 0);
+			break;
+		case QUBES_JACK_TLV_CLOCKED:
+			if (msg.len < sizeof(uint32_t))
+				break;
+			set_peer_clocked(u, read_nth_u32(msg.val, 0) != 0);
+			break;
+		default:
+			// Unknown messages are skipped for forward compatibility
+			break;
 		}
 	}
 }
 
-static int qubes_jack_process(jack_nframes_t nframes, void *arg)
+static void cycle_budget_get(struct userdata *u, struct cycle_budget *b)
 {
-	struct userdata *u = (struct userdata *)arg;
+	jack_nframes_t frames;
+	jack_time_t next;
+
+	b->valid = !jack_get_cycle_times(u->jack_client, &frames, &b->start,
+					 &next, &b->period);
+}
+
+// Has the cycle used more than pct percent of its period by now?
+static bool cycle_budget_spent(const struct cycle_budget *b, unsigned int pct)
+{
+	return b->valid && pct &&
+		jack_get_time() - b->start > b->period * pct / 100;
+}
+
+/*
+ * Play the client's channels through the route onto our ports.  Identity
+ * routes read straight into the port buffers.  While the ports or the
+ * period change, a route that doesn't fit them yet plays silence.
+ */
+static void route_play(struct userdata *u, const struct qubes_jack_route *r,
+		       float **bufs_out, jack_nframes_t nframes)
+{
+	float *mix[MAX_CH];
+	unsigned int c;
+
+	if (r->dests != u->play_count || nframes > u->scratch_frames) {
+		qubes_jack_silence(bufs_out, u->play_count, nframes);
+		return;
+	}
+	if (r->identity) {
+		qubes_jack_stream_recv(&u->play_stream, bufs_out, r->sources,
+				       nframes, u->tmpbuffer);
+		return;
+	}
+
+	for (c = 0; c < r->sources; c++)
+		mix[c] = u->mixbuf + c * nframes;
+	qubes_jack_stream_recv(&u->play_stream, mix, r->sources, nframes,
+			       u->tmpbuffer);
+	qubes_jack_route_run(r, mix, bufs_out, nframes);
+}
+
+// Drop the client's next period, in the width its route reads
+static void route_skip(struct userdata *u, const struct qubes_jack_route *r,
+		       jack_nframes_t nframes)
+{
+	if (r->dests != u->play_count || nframes > u->scratch_frames)
+		return;
+	qubes_jack_stream_skip(&u->play_stream, r->sources, nframes,
+			       u->tmpbuffer);
+}
+
+// Record our ports through the route into the client's channels
+static void route_rec(struct userdata *u, const struct qubes_jack_route *r,
+		      float **bufs_in, jack_nframes_t nframes)
+{
+	float *mix[MAX_CH];
+	unsigned int c;
+
+	if (r->sources != u->record_count || nframes > u->scratch_frames)
+		return;
+	if (r->identity) {
+		qubes_jack_stream_send(&u->rec_stream, bufs_in, r->dests,
+				       nframes, u->tmpbuffer);
+		return;
+	}
+
+	for (c = 0; c < r->dests; c++)
+		mix[c] = u->mixbuf + c * nframes;
+	qubes_jack_route_run(r, bufs_in, mix, nframes);
+	qubes_jack_stream_send(&u->rec_stream, mix, r->dests, nframes,
+			       u->tmpbuffer);
+}
+
+static void process_cycle(struct userdata *u, jack_nframes_t nframes)
+{
+	const struct qos_class *qos = &qos_classes[u->qos];
+	uint64_t start = now_ns();
+	struct cycle_budget budget;
+	uint64_t trace_start = qubes_jack_trace_begin();
 	int t_jack_xruns = u->jack_xruns;
 	int k;
 	unsigned int i;
-	unsigned int c;
-	long f;
-	long j;
 	//fprintf(stderr, "Process...");
 
-	int rec_ready = libvchan_is_open(u->rec);
-	int play_ready = libvchan_is_open(u->play);
+	// Each direction runs as soon as its own vchan is up
+	bool play_on = u->link_up && (u->dirs & QUBES_JACK_DIR_PLAY) &&
+		qubes_jack_chan_is_open(u->play) == 1;
+	bool rec_on = u->link_up && (u->dirs & QUBES_JACK_DIR_REC) &&
+		qubes_jack_chan_is_open(u->rec) == 1;
+	unsigned int held = __atomic_load_n(&u->held, __ATOMIC_ACQUIRE);
 
-	if (rec_ready == 1 && play_ready == 1) {
+	if (play_on || rec_on) {
+		if (u->pause && !u->resume_ns)
+			u->resume_ns = now_ns();
 		u->pause = false;
-	} else if (rec_ready != 1 || play_ready != 1) {
+	} else {
 		u->pause = true;
 	}
+	// Nothing moves in the old width while the client catches up
+	play_on = play_on && !(held & QUBES_JACK_DIR_PLAY);
+	rec_on = rec_on && !(held & QUBES_JACK_DIR_REC);
 	float *bufs_out[u->play_count];
 	float *bufs_in[u->record_count];
 
@@ -247,9 +913,7 @@ static int qubes_jack_process(jack_nframes_t nframes, void *arg)
 	u->jack_xruns -= t_jack_xruns;
 
 	if (!u->ports_ready)
-		return 0;
-
-	process_vchan_client_query(u);
+		return;
 
 	// get jack output buffers
 	for (i = 0; i < u->play_count; i++)
@@ -259,65 +923,61 @@ static int qubes_jack_process(jack_nframes_t nframes, void *arg)
 	for (i = 0; i < u->record_count; i++)
 		bufs_in[i] = (float*)jack_port_get_buffer(u->input_ports[i], nframes);
 
+	cycle_budget_get(u, &budget);
+
 	if (u->pause) {
 		// paused, play silence on output
-		for (c = 0; c < u->play_count; c++) {
-			float *buffer_out = bufs_out[c];
-			for (f = 0; f < nframes; f++) {
-				buffer_out[f] = 0.f;
-			}
-		}
+		qubes_jack_silence(bufs_out, u->play_count, nframes);
 		// paused, capture silence
-		for (c = 0; c < u->record_count; c++) {
-			float *buffer_in = bufs_in[c];
-			for (f = 0; f < nframes; f++) {
-				buffer_in[f] = 0.f;
-			}
-		}
+		qubes_jack_silence(bufs_in, u->record_count, nframes);
+		qubes_jack_trace_instant("paused silence", NULL, nframes);
+	} else if (cycle_budget_spent(&budget, qos->shed_pct)) {
+		// out of budget for our class, drop the period to keep up
+		qubes_jack_silence(bufs_out, u->play_count, nframes);
+		if (play_on)
+			route_skip(u, __atomic_load_n(&u->route[QUBES_JACK_ROUTE_PLAY],
+						      __ATOMIC_ACQUIRE),
+				   nframes);
+		u->qos_shed++;
+		qubes_jack_trace_instant("shed", qos->name, nframes);
+		goto done;
 	} else {
 		// unpaused, play audio
-		//fprintf(stderr, "doing something...");
-		j = u->play_count * nframes * sizeof(float);
-		// read a jack sized block from vchan playback buffer
-		if (libvchan_data_ready(u->play) >= j) {
-			libvchan_read(u->play, u->tmpbuffer, j);
-
-			// write jack sized block to jack (play)
-			for (c = 0; c < u->play_count; c++) {
-				float *buffer_out = bufs_out[c];
-				for (f = 0; f < nframes; f++) {
-					// read interleaved buffer
-					buffer_out[f] = read_nth_float(u->tmpbuffer, c + f * u->play_count);
-				}
-			}
-		} else {
-			// play silence
-			for (c = 0; c < u->play_count; c++) {
-				float *buffer_out = bufs_out[c];
-				for (f = 0; f < nframes; f++) {
-					buffer_out[f] = 0.f;
-				}
-			}
-		}
+		if (play_on)
+			route_play(u, __atomic_load_n(&u->route[QUBES_JACK_ROUTE_PLAY],
+						      __ATOMIC_ACQUIRE),
+				   bufs_out, nframes);
+		else
+			qubes_jack_silence(bufs_out, u->play_count, nframes);
 		// unpaused, record audio
-
-		// capture jack sized buffer and write interleaved floats to tmpbuffer
-		for (c = 0; c < u->record_count; c++) {
-			float *buffer_in = bufs_in[c];
-			for (f = 0; f < nframes; f++) {
-				// write interleaved buffer
-				write_nth_float(u->tmpbuffer, c + f * u->record_count, buffer_in[f]);
-			}
-		}
-		// commit tmpbuffer to vchan
-		//fprintf(stderr, "Buffering...");
-		j = u->record_count * nframes * sizeof(float);
-		if (libvchan_buffer_space(u->rec) >= j) {
-			//fprintf(stderr, "Writing...");
-			libvchan_write(u->rec, u->tmpbuffer, j);
-			//fprintf(stderr, "done\n");
-		}
+		if (rec_on)
+			route_rec(u, __atomic_load_n(&u->route[QUBES_JACK_ROUTE_REC],
+						     __ATOMIC_ACQUIRE),
+				  bufs_in, nframes);
 	}
+
+	/*
+	 * A pass of its own over the ports, as they are heard and as they
+	 * were captured: playback is only final after concealment and the
+	 * route, and the buffers are still in cache from the transfer.
+	 */
+	qubes_jack_meter_run(&u->play_meter, bufs_out, u->play_count, nframes);
+	qubes_jack_meter_run(&u->rec_meter, bufs_in, u->record_count, nframes);
+
+done:
+	if (cycle_budget_spent(&budget, qos->deadline_pct))
+		u->qos_misses++;
+	qubes_jack_hist_add(&u->cb_hist, now_ns() - start);
+	qubes_jack_trace_end(trace_start, "process", NULL, nframes);
+}
+
+static int qubes_jack_process(jack_nframes_t nframes, void *arg)
+{
+	struct userdata *u = (struct userdata *)arg;
+
+	qubes_jack_rt_enter(&u->rt);
+	process_cycle(u, nframes);
+	qubes_jack_rt_leave(&u->rt);
 	return 0;
 }
 
@@ -328,16 +988,53 @@ static void qubes_jack_destroy(struct userdata *u)
 
 	if (u->tmpbuffer)
 		free(u->tmpbuffer);
+	free(u->mixbuf);
 }
 
-static int qubes_jack_init(struct userdata *u)
+static void qos_apply_priority(struct userdata *u)
 {
-	u->tmpbuffer = (char *)malloc(sizeof(float) * MAX_CH * MAX_JACK_BUFFER);
-	if (!u->tmpbuffer) {
-		qubes_jack_destroy(u);
-		return -1;
+	int offset = qos_classes[u->qos].prio_offset;
+	int prio;
+
+	if (!offset || !jack_is_realtime(u->jack_client))
+		return;
+
+	prio = jack_client_real_time_priority(u->jack_client) + offset;
+	if (prio < 1)
+		prio = 1;
+	if (jack_acquire_real_time_scheduling(jack_client_thread_id(u->jack_client),
+					      prio))
+		fprintf(stderr, "Could not lower process thread priority to %d\n",
+			prio);
+}
+
+static int parse_qos(struct userdata *u, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(qos_classes) / sizeof(qos_classes[0]); i++) {
+		if (!strcmp(name, qos_classes[i].name)) {
+			u->qos = i;
+			return 0;
+		}
 	}
+	return -1;
+}
+
+static int parse_route(struct userdata *u, unsigned int dir, const char *spec)
+{
+	struct qubes_jack_route check;
 
+	if (strlen(spec) >= sizeof(u->route_spec[dir]) ||
+	    qubes_jack_route_build(&check, spec, MAX_CH,
+				   dir == QUBES_JACK_ROUTE_PLAY))
+		return -1;
+	strcpy(u->route_spec[dir], spec);
+	return 0;
+}
+
+static int qubes_jack_init(struct userdata *u)
+{
 	const char *jack_client_name = "qubes-vchan-server";
 	u->jack_client = jack_client_open(jack_client_name, JackNoStartServer, NULL);
 
@@ -346,134 +1043,433 @@ static int qubes_jack_init(struct userdata *u)
 		return -1;
 	}
 
+	if (resize_buffers(u, jack_get_buffer_size(u->jack_client))) {
+		qubes_jack_destroy(u);
+		return -1;
+	}
+
 	u->jack_xruns = 0;
 
 	jack_set_process_callback (u->jack_client, qubes_jack_process, u);
 	jack_set_xrun_callback (u->jack_client, qubes_jack_xrun_callback, u);
 	jack_set_graph_order_callback (u->jack_client, qubes_jack_graph_order_callback, u);
+	jack_set_buffer_size_callback (u->jack_client, qubes_jack_buffer_size_callback, u);
+	jack_set_sample_rate_callback (u->jack_client, qubes_jack_sample_rate_callback, u);
+	jack_set_port_registration_callback (u->jack_client, qubes_jack_port_registration_callback, u);
 
 	if (jack_activate (u->jack_client)) {
 		qubes_jack_destroy(u);
 		return -1; 
 	}
 
+	qos_apply_priority(u);
+
 	u->jack_sample_rate = jack_get_sample_rate(u->jack_client);
 	u->jack_buffer_size = jack_get_buffer_size(u->jack_client);
 	u->jack_latency = 16 * 1000 / u->jack_sample_rate;
+	u->play_stream.sample_rate = u->jack_sample_rate;
+	u->rec_stream.sample_rate = u->jack_sample_rate;
 
 	return 0;
 }
 
+// Ring size for the longer of our and the client's periods
+static unsigned int ring_frames(struct userdata *u)
+{
+	unsigned int period = u->jack_buffer_size > u->peer_buffer_size ?
+		u->jack_buffer_size : u->peer_buffer_size;
+	unsigned int frames = QUBES_JACK_RING_FRAMES;
+
+	while (frames < 4 * period)
+		frames *= 2;
+	frames *= u->batch;
+	return frames < QUBES_JACK_MAX_RING_FRAMES ?
+		frames : QUBES_JACK_MAX_RING_FRAMES;
+}
+
 static int vchan_conn(struct userdata *u, int domid)
 {
-	u->play = libvchan_server_init(domid, QUBES_JACK_PLAYBACK_VCHAN_PORT,
-			MAX_CH * sizeof(float) * 1024,
+	u->ring_frames = ring_frames(u);
+	// Fresh rings, nothing left in an old width
+	u->held = 0;
+	u->play = qubes_jack_chan_server_init(u->transport, domid,
+			QUBES_JACK_PLAYBACK_VCHAN_PORT,
+			MAX_CH * sizeof(float) * u->ring_frames,
 			MAX_CH * sizeof(float) * 16);
 	if (!u->play) {
-		fprintf(stderr, "libvchan_server_init play failed\n");
+		fprintf(stderr, "%s server init play failed\n",
+			u->transport->name);
 		return -1;
 	}
-	u->rec = libvchan_server_init(domid, QUBES_JACK_RECORD_VCHAN_PORT,
+	qubes_jack_stream_reset(&u->play_stream, u->play);
+	u->rec = qubes_jack_chan_server_init(u->transport, domid,
+			QUBES_JACK_RECORD_VCHAN_PORT,
 			MAX_CH * sizeof(float) * 16,
-			MAX_CH * sizeof(float) * 1024);
+			MAX_CH * sizeof(float) * u->ring_frames);
 	if (!u->rec) {
-		fprintf(stderr, "libvchan_server_init rec failed\n");
+		fprintf(stderr, "%s server init rec failed\n",
+			u->transport->name);
 		return -1;
 	}
-	u->control = libvchan_server_init(domid, QUBES_JACK_CONFIG_VCHAN_PORT,
-			QUBES_JACK_CONFIG_QUERY_SIZE,
-			QUBES_JACK_CONFIG_QUERY_SIZE);
+	qubes_jack_stream_reset(&u->rec_stream, u->rec);
+	u->control = qubes_jack_chan_server_init(u->transport, domid,
+			QUBES_JACK_CONFIG_VCHAN_PORT,
+			QUBES_JACK_CONTROL_RING_SIZE,
+			QUBES_JACK_CONTROL_RING_SIZE);
 	if (!u->control) {
-		fprintf(stderr, "libvchan_server_init control failed\n");
+		fprintf(stderr, "%s server init control failed\n",
+			u->transport->name);
 		return -1;
 	}
+	qubes_jack_ctrl_init(&u->ctrl, u->control);
 	return 0;
 }
 
+static void push_notifications(struct userdata *u)
+{
+	int notify = __atomic_exchange_n(&u->notify, 0, __ATOMIC_SEQ_CST);
+
+	if (notify & NOTIFY_PORTS)
+		handle_port_change(u);
+
+	if (u->ctrl.version < 2)
+		return;
+
+	if (notify & NOTIFY_BUFFER_SIZE)
+		qubes_jack_ctrl_send_u32(&u->ctrl, QUBES_JACK_TLV_BUFFER_SIZE,
+					 u->jack_buffer_size);
+	if (notify & NOTIFY_SAMPLE_RATE)
+		qubes_jack_ctrl_send_u32(&u->ctrl, QUBES_JACK_TLV_SAMPLE_RATE,
+					 u->jack_sample_rate);
+}
+
 void vchan_done(struct userdata *u)
 {
 	if (u->play)
-		libvchan_close(u->play);
+		qubes_jack_chan_close(u->play);
 
 	if (u->rec)
-		libvchan_close(u->rec);
+		qubes_jack_chan_close(u->rec);
+
+	if (u->control)
+		qubes_jack_chan_close(u->control);
+
+	u->play = NULL;
+	u->rec = NULL;
+	u->control = NULL;
+}
+
+static bool peer_lost(struct userdata *u)
+{
+	uint64_t stale = 5 * QUBES_JACK_HEARTBEAT_MS * 1000000ULL;
+
+	// A vchan closed for a direction the client doesn't use is fine
+	if (qubes_jack_chan_is_open(u->control) == 0 ||
+			(u->play && qubes_jack_chan_is_open(u->play) == 0) ||
+			(u->rec && qubes_jack_chan_is_open(u->rec) == 0))
+		return true;
+
+	// A v2 peer that stopped sending heartbeats is as good as gone
+	return u->ctrl.version >= 2 &&
+		now_ns() - u->ctrl.last_heartbeat_ns > stale;
+}
+
+/*
+ * Notice when the client goes away and listen for it again, so that an
+ * AppVM restart only costs audio until it reconnects.  A period change on
+ * either side that needs bigger rings takes the same path.  Time to first
+ * audio is measured from the RT thread seeing the client back to the first
+ * audio arriving from it.
+ */
+static void check_link(struct userdata *u)
+{
+	uint64_t first;
+
+	if (u->link_up && u->awaiting_audio && u->resume_ns) {
+		first = u->play_stream.first_data_ns;
+		if (!first && !client_channels(u, QUBES_JACK_ROUTE_PLAY))
+			first = u->resume_ns;
+		if (first) {
+			u->awaiting_audio = false;
+			u->last_ttfa_ns = first > u->resume_ns ?
+				first - u->resume_ns : 0;
+			fprintf(stderr, "Client connected after %" PRIu64
+				" ms, time to first audio %" PRIu64 " us\n",
+				(u->resume_ns - u->lost_ns) / 1000000,
+				u->last_ttfa_ns / 1000);
+		}
+	}
+
+	if (u->link_up) {
+		if (ring_frames(u) > u->ring_frames)
+			fprintf(stderr, "Relinking with %u frame rings\n",
+				ring_frames(u));
+		else if (peer_lost(u))
+			fprintf(stderr, "Client lost, waiting for it to reconnect\n");
+		else
+			return;
+
+		u->lost_ns = now_ns();
+		u->link_up = false;
+		qubes_jack_rt_sync(&u->rt);
+		vchan_done(u);
+		set_peer_freewheel(u, false);
+	}
+
+	if (vchan_conn(u, u->domid)) {
+		vchan_done(u);
+		return;
+	}
+
+	u->reconnects++;
+	u->awaiting_audio = true;
+	u->resume_ns = 0;
+	u->link_up = true;
+}
+
+/*
+ * Pick up meter snapshots the RT thread has published and forward them to
+ * the client as they come.
+ */
+static void publish_meters(struct userdata *u)
+{
+	if (qubes_jack_meter_read(&u->play_meter, &u->play_meter_seq,
+				  &u->play_levels))
+		qubes_jack_ctrl_send_meter(&u->ctrl, QUBES_JACK_METER_PLAY,
+					   &u->play_levels);
+	if (qubes_jack_meter_read(&u->rec_meter, &u->rec_meter_seq,
+				  &u->rec_levels))
+		qubes_jack_ctrl_send_meter(&u->ctrl, QUBES_JACK_METER_REC,
+					   &u->rec_levels);
+}
+
+static void control_loop_iteration(struct userdata *u)
+{
+	struct qubes_jack_stat stats[QUBES_JACK_MAX_STATS];
+	struct pollfd pfd;
+	unsigned int n = 0;
+	int timeout = 100;
+
+	if (u->meter_ms && u->meter_ms < 100)
+		timeout = u->meter_ms;
+
+	if (!u->link_up) {
+		// Still waiting to be able to listen again
+		usleep(100000);
+		check_link(u);
+		return;
+	}
+
+	pfd.fd = qubes_jack_chan_fd_for_select(u->control);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) > 0)
+		qubes_jack_chan_wait(u->control);
+
+	process_vchan_client_query(u);
+	push_notifications(u);
+	publish_meters(u);
+	check_held(u);
+
+	check_link(u);
+
+	stats[n].key = QUBES_JACK_STAT_XRUNS;
+	stats[n++].value = u->xrun_total;
+	stats[n].key = QUBES_JACK_STAT_RECONNECTS;
+	stats[n++].value = u->reconnects;
+	stats[n].key = QUBES_JACK_STAT_TTFA_US;
+	stats[n++].value = u->last_ttfa_ns / 1000;
+	stats[n].key = QUBES_JACK_STAT_CB_P99_US;
+	stats[n++].value = qubes_jack_hist_percentile(&u->cb_hist, 990) / 1000;
+	stats[n].key = QUBES_JACK_STAT_CB_MAX_US;
+	stats[n++].value = u->cb_hist.max_ns / 1000;
+	stats[n].key = QUBES_JACK_STAT_QOS_CLASS;
+	stats[n++].value = u->qos;
+	stats[n].key = QUBES_JACK_STAT_QOS_SHED;
+	stats[n++].value = u->qos_shed;
+	stats[n].key = QUBES_JACK_STAT_QOS_MISSES;
+	stats[n++].value = u->qos_misses;
+	n = qubes_jack_stream_stats(stats, n, QUBES_JACK_STAT_PLAY_BASE,
+				    &u->play_stream);
+	n = qubes_jack_stream_stats(stats, n, QUBES_JACK_STAT_REC_BASE,
+				    &u->rec_stream);
+	qubes_jack_ctrl_tick(&u->ctrl, stats, n);
 }
 
 int main(int argc, char **argv)
 {
-	unsigned int c;
 	struct userdata u;
+	const char *capture_path = NULL;
+	const char *trace_path = NULL;
+	size_t capture_mb = QUBES_JACK_CAPTURE_DEFAULT_MB;
+	int opt;
 
+	memset(&u, 0, sizeof(u));
 	u.pause = true;
 	u.ports_ready = false;
+	qubes_jack_stream_init(&u.play_stream, "playback");
+	qubes_jack_stream_init(&u.rec_stream, "record");
+	u.play_stream.cancel = &u.rt.cancel;
+	u.rec_stream.cancel = &u.rt.cancel;
+	u.batch = 1;
+	u.max_channels = MAX_CH;
+	u.qos = QOS_DEFAULT;
+	u.dirs = QUBES_JACK_DIR_DUPLEX;
+	u.transport = &qubes_jack_transport_vchan;
+	u.route[QUBES_JACK_ROUTE_PLAY] = &u.routes[QUBES_JACK_ROUTE_PLAY][0];
+	u.route[QUBES_JACK_ROUTE_REC] = &u.routes[QUBES_JACK_ROUTE_REC][0];
+
+	while ((opt = getopt(argc, argv, "p:r:l:b:m:n:q:t:w:W:T:o:i:Rh")) != -1) {
+		switch (opt) {
+		case 'b':
+			u.batch = atoi(optarg);
+			if (qubes_jack_stream_set_batch(&u.play_stream, u.batch) ||
+			    qubes_jack_stream_set_batch(&u.rec_stream, u.batch)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (qubes_jack_parse_policy(&u.play_stream, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (qubes_jack_parse_policy(&u.rec_stream, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			u.play_stream.max_latency = atoi(optarg);
+			u.rec_stream.max_latency = u.play_stream.max_latency;
+			break;
+		case 'm':
+			u.meter_ms = atoi(optarg);
+			break;
+		case 'n':
+			u.max_channels = atoi(optarg);
+			if (u.max_channels < 1 || u.max_channels > MAX_CH) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			if (parse_qos(&u, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			u.transport = qubes_jack_transport_find(optarg);
+			if (!u.transport) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'o':
+		case 'i':
+			if (parse_route(&u, opt == 'o' ? QUBES_JACK_ROUTE_PLAY :
+					QUBES_JACK_ROUTE_REC, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'R':
+			u.route_updates = true;
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'W':
+			capture_mb = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-	if (argc < 2) {
-		fprintf(stderr, "Error: need remote domid");
+	if (optind >= argc) {
+		fprintf(stderr, "Error: need remote domid\n");
+		usage(argv[0]);
 		return 1;
 	}
-	fprintf(stderr, "Open vchan...");
-	if (vchan_conn(&u, atoi(argv[1])))
+	if (trace_path && qubes_jack_trace_open(trace_path,
+						QUBES_JACK_TRACE_PID_SERVER,
+						"SoundVM server"))
 		return 1;
-	fprintf(stderr, "done\n");
-
 	fprintf(stderr, "Open JACK...");
 	if (qubes_jack_init(&u))
 		return 1;
 	fprintf(stderr, "done\n");
 
-	fprintf(stderr, "Get config...");
-	get_jack_play_port_count(&u);
-	get_jack_rec_port_count(&u);
+	// After JACK, so that the rings are sized for our period
+	fprintf(stderr, "Open vchan...");
+	u.domid = atoi(argv[optind]);
+	if (vchan_conn(&u, u.domid))
+		return 1;
+	u.link_up = true;
+	u.awaiting_audio = true;
+	u.lost_ns = now_ns();
 	fprintf(stderr, "done\n");
 
-	fprintf(stderr, "Connect ports...");
-	for (c = 0; c < u.play_count; c++) {
-		char portname[20];
-		snprintf(portname, 20, "out_%d", c);
-		u.output_ports[c] = jack_port_register(u.jack_client,
-					portname,
-					JACK_DEFAULT_AUDIO_TYPE,
-					JackPortIsOutput, 0);
+	qubes_jack_meter_init(&u.play_meter, u.jack_sample_rate, u.meter_ms);
+	qubes_jack_meter_init(&u.rec_meter, u.jack_sample_rate, u.meter_ms);
+
+	if (capture_path) {
+		if (qubes_jack_capture_open(capture_path, capture_mb))
+			return 1;
+		qubes_jack_capture_info(QUBES_JACK_CAP_ROLE_SERVER,
+					u.jack_sample_rate, u.play_stream.batch,
+					u.rec_stream.batch);
+		u.play_stream.capture_id = QUBES_JACK_CAP_STREAM_PLAY;
+		u.rec_stream.capture_id = QUBES_JACK_CAP_STREAM_REC;
 	}
 
-	for (c = 0; c < u.record_count; c++) {
-		char portname[20];
-		snprintf(portname, 20, "in_%d", c);
-		u.input_ports[c] = jack_port_register(u.jack_client,
-					portname,
-					JACK_DEFAULT_AUDIO_TYPE,
-					JackPortIsInput, 0);
-	}
+	fprintf(stderr, "Get config...");
+	u.play_count = count_physical_ports(&u, JackPortIsInput);
+	u.record_count = count_physical_ports(&u, JackPortIsOutput);
+	fprintf(stderr, "done\n");
 
+	fprintf(stderr, "Connect ports...");
+	open_jack_ports(&u);
 	qubes_jack_connect_ports(&u);
+	apply_routes(&u);
 	u.ports_ready = true;
 	u.pause = false;
 	fprintf(stderr, "done\n");
 
-	// Wait until killed
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGUSR1, handle_signal);
+
+	// Serve the control channel until killed, SIGUSR1 dumps counters
 	fprintf(stderr, "Wait for kill...");
-	sleep(-1);
+	while (!quit) {
+		control_loop_iteration(&u);
+		if (dump_stats) {
+			dump_stats = 0;
+			print_stats(&u);
+		}
+	}
 	fprintf(stderr, "done\n");
 
 	// shutdown
 	u.pause = true;
 	u.ports_ready = false;
 
-	for (c = 0; c < u.play_count; c++) {
-		if (u.output_ports[c]) {
-        		jack_port_unregister (u.jack_client, u.output_ports[c]);
-        		u.output_ports[c] = NULL;
-		}
-	}
-
-	for (c = 0; c < u.record_count; c++) {
-		if (u.input_ports[c]) {
-			jack_port_unregister (u.jack_client, u.input_ports[c]);
-			u.input_ports[c] = NULL;
-		}
-	}
+	close_jack_ports(&u);
 
 	qubes_jack_destroy(&u);
+	qubes_jack_trace_close();
 	vchan_done(&u);
+	qubes_jack_capture_close();
+	print_stats(&u);
+	qubes_jack_stream_destroy(&u.play_stream);
+	qubes_jack_stream_destroy(&u.rec_stream);
 	return 0;
 }
@@ -0,0 +1,184 @@
+#!/bin/sh
+#
+# Soak test: many simulated AppVMs against one SoundVM on a single machine.
+#
+# Each simulated AppVM is a client/server pair joined by the memfd
+# transport, the servers on one dummy jackd and the clients on another.
+# Channel counts, transfer sizes and directions vary between pairs, the
+# period varies between runs, and clients are restarted at random while
+# the test runs.  Reports server CPU and memory per client, xruns and
+# callback times for each scale.
+#
+# Environment: SOAK_CLIENTS (default "1 8 32 64"), SOAK_SECONDS (30),
+# SOAK_CHURN (2, seconds between client restarts), SOAK_PERIODS ("64 256
+# 1024", taken in turn by the runs), SOAK_RATE (48000), SOAK_JACKD_OPTS
+# ("-r", jackd without realtime).
+
+CLIENTS=${SOAK_CLIENTS:-1 8 32 64}
+SECONDS_PER_RUN=${SOAK_SECONDS:-30}
+CHURN=${SOAK_CHURN:-2}
+PERIODS=${SOAK_PERIODS:-64 256 1024}
+RATE=${SOAK_RATE:-48000}
+JACKD_OPTS=${SOAK_JACKD_OPTS:--r}
+
+SERVER="./qubes-vchan-jack-server -t memfd"
+CLIENT="./qubes-vchan-jack-client -t memfd"
+SOUNDVM=soak-soundvm
+APPVM=soak-appvm
+DOMID_BASE=1000
+LOGDIR=$(mktemp -d /tmp/qubes-jack-soak.XXXXXX)
+QUBES_JACK_MEMFD_DIR=$(mktemp -d /tmp/qubes-jack-soak-sock.XXXXXX)
+export QUBES_JACK_MEMFD_DIR
+HZ=$(getconf CLK_TCK)
+
+PIDS=""
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -f "$QUBES_JACK_MEMFD_DIR"/qubes-jack-*.sock
+	rmdir "$QUBES_JACK_MEMFD_DIR" 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Both jackds, at a period of $1
+start_jackds() {
+	jackds=""
+	for name in $SOUNDVM $APPVM; do
+		jackd $JACKD_OPTS -n "$name" -d dummy -r "$RATE" -p "$1" -C 8 -P 8 \
+			>"$LOGDIR/jackd-$name-$1.log" 2>&1 &
+		jackds="$jackds $!"
+	done
+	PIDS="$PIDS $jackds"
+	sleep 2
+}
+
+stop_jackds() {
+	kill $jackds 2>/dev/null
+	wait $jackds 2>/dev/null
+}
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+rss_kb() {
+	awk '/^VmRSS:/ { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0
+}
+
+# Most AppVMs only play
+directions() {
+	case $(($1 % 4)) in
+	0) echo duplex ;;
+	1) echo record ;;
+	*) echo play ;;
+	esac
+}
+
+start_client() {
+	JACK_DEFAULT_SERVER=$APPVM $CLIENT -d "$(directions "$1")" "$1" \
+		>"$LOGDIR/client-$1.log" 2>&1 &
+	echo $!
+}
+
+qos_class() {
+	case $(($1 % 3)) in
+	0) echo normal ;;
+	1) echo best-effort ;;
+	*) echo realtime ;;
+	esac
+}
+
+run() {
+	n=$1
+	period=$2
+	servers=""
+	clients=""
+	i=0
+
+	start_jackds "$period"
+
+	while [ "$i" -lt "$n" ]; do
+		d=$((DOMID_BASE + i))
+		JACK_DEFAULT_SERVER=$SOUNDVM $SERVER -n $((i % 8 + 1)) \
+			-b $((1 << (i % 3))) -q "$(qos_class "$i")" "$d" >"$LOGDIR/server-$n-$d.log" 2>&1 &
+		servers="$servers $!"
+		i=$((i + 1))
+	done
+	sleep 1
+
+	i=0
+	while [ "$i" -lt "$n" ]; do
+		clients="$clients $(start_client $((DOMID_BASE + i)))"
+		i=$((i + 1))
+	done
+	sleep 2
+
+	start=0
+	for p in $servers; do
+		start=$((start + $(cpu_ticks "$p")))
+	done
+	# Restarts take longer than CHURN, so time the run rather than
+	# trusting SECONDS_PER_RUN
+	t0=$(date +%s.%N)
+
+	elapsed=0
+	while [ "$elapsed" -lt "$SECONDS_PER_RUN" ]; do
+		sleep "$CHURN"
+		elapsed=$((elapsed + CHURN))
+
+		# Restart one client, which the server sees as a VM reboot
+		k=$(awk -v n="$n" -v s="$elapsed" 'BEGIN { srand(s); print int(rand() * n) }')
+		set -- $clients
+		shift "$k"
+		kill "$1" 2>/dev/null
+		wait "$1" 2>/dev/null
+		sleep 1
+		new=$(start_client $((DOMID_BASE + k)))
+		clients=$(echo "$clients" | sed "s/\\<$1\\>/$new/")
+	done
+
+	end=0
+	rss=0
+	for p in $servers; do
+		end=$((end + $(cpu_ticks "$p")))
+		rss=$((rss + $(rss_kb "$p")))
+	done
+	t1=$(date +%s.%N)
+	kill $servers $clients 2>/dev/null
+	wait $servers $clients 2>/dev/null
+	stop_jackds
+
+	# Each server prints its stats once, on the way out
+	cat "$LOGDIR"/server-"$n"-*.log | awk -v n="$n" -v ticks=$((end - start)) \
+		-v hz="$HZ" -v t0="$t0" -v t1="$t1" -v rss="$rss" -v period="$period" '
+		/^xruns:/ { gsub(",", "", $2); xruns += $2 }
+		/^qos:/ { gsub(",", "", $3); shed[$3] += $6; miss[$3] += $9 }
+		/^callback:/ {
+			for (f = 1; f < NF; f++)
+				if ($f == "p99") { p99 = $(f + 1); if (p99 > max99) max99 = p99 }
+		}
+		END {
+			printf "%3d clients, %4d frames: cpu %.2f%% per client, rss %d KiB per client, xruns %d, worst p99 callback %d us\n",
+				n, period, 100 * ticks / hz / (t1 - t0) / n, rss / n, xruns, max99
+			for (c in miss)
+				printf "     %s: shed %d, deadline misses %d\n", c, shed[c], miss[c]
+		}'
+}
+
+for b in ./qubes-vchan-jack-server ./qubes-vchan-jack-client; do
+	if [ ! -x "$b" ]; then
+		echo "$b missing, run make soak" >&2
+		exit 1
+	fi
+done
+
+set -- $PERIODS
+for n in $CLIENTS; do
+	run "$n" "$1"
+	shift
+	[ $# -eq 0 ] && set -- $PERIODS
+done
+echo "logs in $LOGDIR"
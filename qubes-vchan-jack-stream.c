@@ -0,0 +1,699 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+
+#include "qubes-vchan-jack.h"
+#include "qubes-vchan-jack-stream.h"
+#include "qubes-vchan-jack-capture.h"
+#include "qubes-vchan-jack-trace.h"
+
+static const char *policy_names[] = {
+	[QUBES_JACK_POLICY_DROP_NEWEST] = "drop-newest",
+	[QUBES_JACK_POLICY_DROP_OLDEST] = "drop-oldest",
+	[QUBES_JACK_POLICY_BLOCK] = "block",
+};
+
+void qubes_jack_stream_init(struct qubes_jack_stream *s, const char *name)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->policy = QUBES_JACK_POLICY_DROP_NEWEST;
+	s->batch = 1;
+	s->max_frames = MAX_JACK_BUFFER;
+	s->start_ns = now_ns();
+	s->capture_id = -1;
+}
+
+static inline bool capturing(const struct qubes_jack_stream *s)
+{
+	return s->capture_id >= 0 && qubes_jack_capture_active;
+}
+
+void qubes_jack_stream_destroy(struct qubes_jack_stream *s)
+{
+	free(s->batch_buf);
+	s->batch_buf = NULL;
+	s->batch = 1;
+}
+
+/*
+ * Not RT safe: the caller keeps the process callback away from the stream
+ * while the staging buffer is swapped.
+ */
+int qubes_jack_stream_set_batch(struct qubes_jack_stream *s, unsigned int batch)
+{
+	char *buf = NULL;
+
+	if (batch < 1 || batch > QUBES_JACK_MAX_BATCH)
+		return -1;
+
+	if (batch > 1) {
+		buf = malloc(batch * QUBES_JACK_SCRATCH_BYTES(s->max_frames));
+		if (!buf)
+			return -1;
+	}
+
+	free(s->batch_buf);
+	s->batch_buf = buf;
+	s->batch = batch;
+	s->batch_fill = 0;
+	s->batch_pos = 0;
+	s->batch_pending = 0;
+	s->batch_count = 0;
+	s->primed = false;
+	return 0;
+}
+
+/*
+ * Size the staging buffer for periods of up to frames frames.  Not RT
+ * safe, as for qubes_jack_stream_set_batch().  On failure the stream
+ * keeps its old size, and periods longer than that are dropped.
+ */
+int qubes_jack_stream_set_period(struct qubes_jack_stream *s, uint32_t frames)
+{
+	uint32_t old = s->max_frames;
+
+	if (frames < 1 || frames > MAX_JACK_BUFFER)
+		return -1;
+
+	s->max_frames = frames;
+	if (qubes_jack_stream_set_batch(s, s->batch)) {
+		s->max_frames = old;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Attach the stream to a new vchan after a reconnect.  Counters carry on
+ * across reconnects.
+ */
+void qubes_jack_stream_reset(struct qubes_jack_stream *s, struct qubes_jack_chan *ctrl)
+{
+	s->ctrl = ctrl;
+	s->in_excursion = false;
+	s->first_data_ns = 0;
+	s->batch_fill = 0;
+	s->batch_pos = 0;
+	s->batch_pending = 0;
+	s->batch_count = 0;
+	s->primed = false;
+	s->conceal_len = 0;
+	s->conceal_run = 0;
+}
+
+/*
+ * Throw away everything queued to us and anything staged for a batch,
+ * e.g. frames in a channel count that no longer applies.  Only for the
+ * control thread while the process callback keeps off the stream.
+ */
+void qubes_jack_stream_flush(struct qubes_jack_stream *s)
+{
+	char buf[4096];
+	long left, chunk;
+
+	if (s->ctrl) {
+		left = qubes_jack_chan_data_ready(s->ctrl);
+		while (left > 0) {
+			chunk = left < (long)sizeof(buf) ? left : (long)sizeof(buf);
+			chunk = qubes_jack_chan_read(s->ctrl, buf, chunk);
+			if (chunk <= 0)
+				break;
+			if (capturing(s))
+				qubes_jack_capture(QUBES_JACK_CAP_DISCARD,
+						   s->capture_id, buf, chunk);
+			left -= chunk;
+		}
+	}
+	s->batch_fill = 0;
+	s->batch_pos = 0;
+	s->batch_pending = 0;
+	s->batch_count = 0;
+	s->primed = false;
+	s->conceal_len = 0;
+	s->conceal_run = 0;
+}
+
+/*
+ * Parse "drop-newest", "drop-oldest", "block" or "block:<timeout_ms>".
+ */
+int qubes_jack_parse_policy(struct qubes_jack_stream *s, const char *arg)
+{
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+		len = strlen(policy_names[i]);
+		if (strncmp(arg, policy_names[i], len))
+			continue;
+		if (arg[len] == '\0') {
+			s->policy = i;
+			return 0;
+		}
+		if (i == QUBES_JACK_POLICY_BLOCK && arg[len] == ':') {
+			s->policy = i;
+			s->timeout_ms = atoi(arg + len + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Block until the vchan has at least j bytes of data (or space, when
+ * for_space is set), the peer goes away or timeout_ms passes.  A negative
+ * timeout waits for as long as the peer stays connected.  The timeout is
+ * for the whole wait, however many notifications arrive in the meantime.
+ * Setting *cancel ends the wait within QUBES_JACK_CANCEL_POLL_MS.
+ */
+int qubes_jack_vchan_wait_ready(struct qubes_jack_chan *ctrl, long j, int timeout_ms,
+				const volatile bool *cancel,
+				bool for_space)
+{
+	uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000;
+	struct pollfd pfd;
+	int64_t left_ns;
+	int wait_ms = -1;
+	int ret;
+
+	pfd.fd = qubes_jack_chan_fd_for_select(ctrl);
+	pfd.events = POLLIN;
+
+	while ((for_space ? qubes_jack_chan_buffer_space(ctrl)
+			  : qubes_jack_chan_data_ready(ctrl)) < j) {
+		if (qubes_jack_chan_is_open(ctrl) != 1)
+			return -1;
+		if (cancel && *cancel)
+			return -1;
+		if (timeout_ms >= 0) {
+			left_ns = (int64_t)(deadline - now_ns());
+			if (left_ns <= 0)
+				return -1;
+			wait_ms = (left_ns + 999999) / 1000000;
+		}
+		if (cancel && (wait_ms < 0 || wait_ms > QUBES_JACK_CANCEL_POLL_MS))
+			wait_ms = QUBES_JACK_CANCEL_POLL_MS;
+		ret = poll(&pfd, 1, wait_ms);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			qubes_jack_chan_wait(ctrl);
+	}
+	return 0;
+}
+
+void qubes_jack_silence(float **bufs, unsigned int channels, uint32_t nframes)
+{
+	unsigned int c;
+
+	for (c = 0; c < channels; c++)
+		memset(bufs[c], 0, nframes * sizeof(float));
+}
+
+static int stream_wait(struct qubes_jack_stream *s, long j, uint32_t nframes,
+		       bool for_space)
+{
+	int timeout_ms = s->timeout_ms;
+	uint64_t t;
+	int ret;
+
+	if (s->policy != QUBES_JACK_POLICY_BLOCK && !s->lossless)
+		return 0;
+
+	if (s->lossless)
+		timeout_ms = -1;
+	else if (timeout_ms == 0 && s->sample_rate)
+		timeout_ms = 4 * nframes * 1000 / s->sample_rate + 1;
+
+	t = qubes_jack_trace_begin();
+	ret = qubes_jack_vchan_wait_ready(s->ctrl, j, timeout_ms, s->cancel,
+					  for_space);
+	qubes_jack_trace_end(t, "wait", s->name, j);
+	if (ret && !s->lossless)
+		s->stats.block_timeouts++;
+	return ret;
+}
+
+void qubes_jack_stream_send(struct qubes_jack_stream *s, float **bufs,
+			    unsigned int channels, uint32_t nframes,
+			    char *scratch)
+{
+	long j = channels * nframes * sizeof(float);
+	char *out = scratch;
+	unsigned int c;
+	long f;
+
+	if (!j)
+		return;
+
+	s->stats.periods++;
+	if (capturing(s))
+		qubes_jack_capture_period(s->capture_id, nframes, channels,
+					  false, -1);
+
+	// Buffers not resized for this period yet
+	if (nframes > s->max_frames) {
+		s->stats.overflow_frames += nframes;
+		qubes_jack_trace_instant("overflow", s->name, nframes);
+		return;
+	}
+
+	// In the throughput profile, stage periods until a batch is full
+	if (s->batch > 1) {
+		if (s->batch_fill + j >
+		    (long)(s->batch * QUBES_JACK_SCRATCH_BYTES(s->max_frames)))
+			s->batch_fill = 0;
+		out = s->batch_buf + s->batch_fill;
+	}
+
+	// capture jack sized buffer and write interleaved floats to out
+	for (c = 0; c < channels; c++) {
+		float *buffer_in = bufs[c];
+		for (f = 0; f < nframes; f++) {
+			// write interleaved buffer
+			write_nth_float(out, c + f * channels, buffer_in[f]);
+		}
+	}
+
+	if (s->batch > 1) {
+		s->batch_fill += j;
+		if (++s->batch_count < s->batch)
+			return;
+		out = s->batch_buf;
+		j = s->batch_fill;
+		nframes = j / (channels * sizeof(float));
+		s->batch_fill = 0;
+		s->batch_count = 0;
+	}
+
+	// commit to vchan
+	stream_wait(s, j, nframes, true);
+	if (qubes_jack_chan_buffer_space(s->ctrl) >= j) {
+		uint64_t t = qubes_jack_trace_begin();
+
+		qubes_jack_chan_write(s->ctrl, out, j);
+		qubes_jack_trace_end(t, "write", s->name, j);
+		s->stats.transfers++;
+		if (capturing(s))
+			qubes_jack_capture(QUBES_JACK_CAP_SEND, s->capture_id,
+					   out, j);
+	} else {
+		s->stats.overflow_frames += nframes;
+		qubes_jack_trace_instant("overflow", s->name, nframes);
+	}
+}
+
+/*
+ * Keep track of how far behind the sender we are, and for drop-oldest
+ * throw away the oldest queued frames so that at most max_latency frames
+ * stay queued once this period has been read.
+ */
+static void stream_check_backlog(struct qubes_jack_stream *s,
+				 unsigned int channels, uint32_t nframes,
+				 char *scratch)
+{
+	long frame_size = channels * sizeof(float);
+	long backlog = qubes_jack_chan_data_ready(s->ctrl) / frame_size;
+	long bound = s->max_latency ? s->max_latency : (s->batch + 1) * nframes;
+	long excess, chunk;
+
+	if (backlog > s->stats.max_backlog)
+		s->stats.max_backlog = backlog;
+
+	if (backlog <= nframes + bound) {
+		s->in_excursion = false;
+		return;
+	}
+	if (!s->in_excursion) {
+		s->stats.latency_excursions++;
+		s->in_excursion = true;
+	}
+	if (s->policy != QUBES_JACK_POLICY_DROP_OLDEST || s->lossless ||
+	    s->keep_backlog)
+		return;
+
+	excess = backlog - nframes - bound;
+	s->stats.discarded_frames += excess;
+	qubes_jack_trace_instant("discard", s->name, excess);
+	while (excess > 0) {
+		chunk = excess;
+		if (chunk * frame_size > (long)QUBES_JACK_SCRATCH_BYTES(s->max_frames))
+			chunk = QUBES_JACK_SCRATCH_BYTES(s->max_frames) / frame_size;
+		qubes_jack_chan_read(s->ctrl, scratch, chunk * frame_size);
+		if (capturing(s))
+			qubes_jack_capture(QUBES_JACK_CAP_DISCARD, s->capture_id,
+					   scratch, chunk * frame_size);
+		excess -= chunk;
+	}
+}
+
+static void deinterleave(float **bufs, unsigned int channels,
+			 uint32_t nframes, char *in)
+{
+	unsigned int c;
+	long f;
+
+	// write jack sized block to jack
+	for (c = 0; c < channels; c++) {
+		float *buffer_out = bufs[c];
+		for (f = 0; f < nframes; f++) {
+			// read interleaved buffer
+			buffer_out[f] = read_nth_float(in, c + f * channels);
+		}
+	}
+}
+
+/*
+ * Remember the last frames of real audio in bufs[.][0, nframes), oldest
+ * first, for concealing a later underrun.
+ */
+static void conceal_save(struct qubes_jack_stream *s, float **bufs,
+			 unsigned int channels, uint32_t nframes)
+{
+	unsigned int keep, n = QUBES_JACK_CONCEAL_FRAMES;
+	unsigned int c;
+
+	if (!nframes)
+		return;
+	if (nframes > n)
+		nframes = n;
+	keep = s->conceal_len + nframes > n ? n - nframes : s->conceal_len;
+
+	for (c = 0; c < channels && c < MAX_CH; c++) {
+		memmove(s->conceal_hist[c], s->conceal_hist[c] + s->conceal_len - keep,
+			keep * sizeof(float));
+		memcpy(s->conceal_hist[c] + keep, bufs[c], nframes * sizeof(float));
+	}
+	s->conceal_len = keep + nframes;
+}
+
+/*
+ * Concealed sample run frames into an underrun: the saved audio played
+ * backwards then forwards, so there is never a jump where it repeats,
+ * fading out as it goes.
+ */
+static float conceal_sample(const struct qubes_jack_stream *s,
+			    unsigned int c, unsigned int run)
+{
+	unsigned int len = s->conceal_len;
+	unsigned int p = run % (2 * len);
+	float gain;
+
+	if (run >= QUBES_JACK_CONCEAL_FADE)
+		return 0.f;
+	gain = 1.f - (float)run / QUBES_JACK_CONCEAL_FADE;
+	return s->conceal_hist[c < MAX_CH ? c : 0][p < len ? len - 1 - p : p - len] *
+		gain;
+}
+
+/*
+ * Fill frames [from, nframes) with concealment, which is much less
+ * audible than dropping straight to silence.  Consecutive underruns carry
+ * on the same fade.
+ */
+static void conceal_fill(struct qubes_jack_stream *s, float **bufs,
+			 unsigned int channels, uint32_t from, uint32_t nframes)
+{
+	unsigned int len = s->conceal_len;
+	unsigned int c, run;
+	uint32_t f;
+
+	if (!len || s->conceal_run >= QUBES_JACK_CONCEAL_FADE) {
+		for (c = 0; c < channels; c++)
+			memset(bufs[c] + from, 0, (nframes - from) * sizeof(float));
+		return;
+	}
+
+	for (c = 0; c < channels; c++) {
+		run = s->conceal_run;
+		for (f = from; f < nframes; f++, run++)
+			bufs[c][f] = conceal_sample(s, c, run);
+	}
+
+	run = s->conceal_run + nframes - from;
+	s->stats.concealed_frames += (run < QUBES_JACK_CONCEAL_FADE ?
+				      run : QUBES_JACK_CONCEAL_FADE) - s->conceal_run;
+	s->conceal_run = run;
+}
+
+// After concealment, crossfade from where it had got to into real audio
+static void conceal_resume(struct qubes_jack_stream *s, float **bufs,
+			   unsigned int channels, uint32_t nframes)
+{
+	unsigned int c;
+	uint32_t f, n = nframes < QUBES_JACK_CONCEAL_RAMP ?
+		nframes : QUBES_JACK_CONCEAL_RAMP;
+	float w;
+
+	if (!s->conceal_run)
+		return;
+
+	for (c = 0; c < channels; c++) {
+		for (f = 0; f < n; f++) {
+			w = (float)(f + 1) / (n + 1);
+			bufs[c][f] = bufs[c][f] * w + (1.f - w) *
+				conceal_sample(s, c, s->conceal_run + f);
+		}
+	}
+	s->conceal_run = 0;
+}
+
+/*
+ * Throughput profile: only touch the vchan once the staged batch has been
+ * handed out, then take as many whole periods as are queued, up to a
+ * batch.  Every data_ready/read arms or sends an event channel
+ * notification, so staying off the ring in between is what saves them.
+ */
+static void stream_recv_batch(struct qubes_jack_stream *s, float **bufs,
+			      unsigned int channels, uint32_t nframes,
+			      long j, long ready)
+{
+	long periods = ready / j;
+	uint64_t t;
+
+	if (periods > s->batch)
+		periods = s->batch;
+
+	t = qubes_jack_trace_begin();
+	qubes_jack_chan_read(s->ctrl, s->batch_buf, periods * j);
+	qubes_jack_trace_end(t, "read", s->name, periods * j);
+	s->stats.transfers++;
+	if (capturing(s))
+		qubes_jack_capture(QUBES_JACK_CAP_RECV, s->capture_id,
+				   s->batch_buf, periods * j);
+	s->batch_pos = 0;
+	s->batch_pending = periods * j;
+
+	/*
+	 * Batches land every batch periods, so run one period behind the
+	 * sender; otherwise the next batch races with our cycle that needs it.
+	 */
+	if (!s->primed) {
+		s->primed = true;
+		qubes_jack_silence(bufs, channels, nframes);
+		return;
+	}
+
+	deinterleave(bufs, channels, nframes, s->batch_buf);
+	s->batch_pos = j;
+	s->batch_pending -= j;
+}
+
+/*
+ * Less than a period has arrived.  Play what there is rather than leaving
+ * it to arrive late and shift the stream, and conceal the missing tail.
+ * The throughput profile hands out whole periods only, so it still plays
+ * silence.
+ */
+static void stream_recv_partial(struct qubes_jack_stream *s, float **bufs,
+				unsigned int channels, uint32_t nframes,
+				long ready, char *scratch)
+{
+	long frame_size = channels * sizeof(float);
+	uint32_t got = ready / frame_size;
+	uint64_t t;
+
+	s->primed = false;
+	if (s->batch > 1)
+		got = 0;
+
+	if (got) {
+		t = qubes_jack_trace_begin();
+		qubes_jack_chan_read(s->ctrl, scratch, got * frame_size);
+		qubes_jack_trace_end(t, "read", s->name, got * frame_size);
+		s->stats.transfers++;
+		if (capturing(s))
+			qubes_jack_capture(QUBES_JACK_CAP_RECV, s->capture_id,
+					   scratch, got * frame_size);
+		if (!s->first_data_ns)
+			s->first_data_ns = now_ns();
+		deinterleave(bufs, channels, got, scratch);
+		conceal_resume(s, bufs, channels, got);
+		conceal_save(s, bufs, channels, got);
+	}
+
+	if (s->batch > 1)
+		qubes_jack_silence(bufs, channels, nframes);
+	else
+		conceal_fill(s, bufs, channels, got, nframes);
+	s->stats.underflow_frames += nframes - got;
+	qubes_jack_trace_instant("underflow", s->name, nframes - got);
+}
+
+void qubes_jack_stream_recv(struct qubes_jack_stream *s, float **bufs,
+			    unsigned int channels, uint32_t nframes,
+			    char *scratch)
+{
+	long j = channels * nframes * sizeof(float);
+	long ready;
+	uint64_t t;
+
+	if (!j)
+		return;
+
+	s->stats.periods++;
+
+	// Buffers not resized for this period yet
+	if (nframes > s->max_frames) {
+		qubes_jack_silence(bufs, channels, nframes);
+		s->stats.underflow_frames += nframes;
+		qubes_jack_trace_instant("underflow", s->name, nframes);
+		return;
+	}
+
+	if (s->batch > 1 && s->batch_pending >= j) {
+		if (capturing(s))
+			qubes_jack_capture_period(s->capture_id, nframes,
+						  channels, true, -1);
+		deinterleave(bufs, channels, nframes,
+			     s->batch_buf + s->batch_pos);
+		s->batch_pos += j;
+		s->batch_pending -= j;
+		return;
+	}
+
+	stream_wait(s, j, nframes, false);
+	if (capturing(s))
+		qubes_jack_capture_period(s->capture_id, nframes, channels,
+					  true, qubes_jack_chan_data_ready(s->ctrl));
+	stream_check_backlog(s, channels, nframes, scratch);
+
+	ready = qubes_jack_chan_data_ready(s->ctrl);
+	if (ready < j) {
+		stream_recv_partial(s, bufs, channels, nframes, ready, scratch);
+		return;
+	}
+
+	if (!s->first_data_ns)
+		s->first_data_ns = now_ns();
+
+	if (s->batch > 1) {
+		stream_recv_batch(s, bufs, channels, nframes, j, ready);
+		return;
+	}
+
+	// read a jack sized block from vchan
+	t = qubes_jack_trace_begin();
+	qubes_jack_chan_read(s->ctrl, scratch, j);
+	qubes_jack_trace_end(t, "read", s->name, j);
+	s->stats.transfers++;
+	if (capturing(s))
+		qubes_jack_capture(QUBES_JACK_CAP_RECV, s->capture_id,
+				   scratch, j);
+	deinterleave(bufs, channels, nframes, scratch);
+	conceal_resume(s, bufs, channels, nframes);
+	conceal_save(s, bufs, channels, nframes);
+}
+
+/*
+ * Throw the next period away unplayed, for a cycle with no time to play
+ * it.  The sender keeps its pace, so leaving the period queued would add
+ * a period of latency for good.  Never waits, and keeps everything while
+ * the stream must not lose audio.
+ */
+void qubes_jack_stream_skip(struct qubes_jack_stream *s, unsigned int channels,
+			    uint32_t nframes, char *scratch)
+{
+	long frame_size = channels * sizeof(float);
+	long j = nframes * frame_size;
+	long ready;
+
+	if (!j || nframes > s->max_frames || s->lossless || s->keep_backlog)
+		return;
+
+	if (s->batch > 1 && s->batch_pending >= j) {
+		s->batch_pos += j;
+		s->batch_pending -= j;
+		s->stats.discarded_frames += nframes;
+		return;
+	}
+
+	ready = qubes_jack_chan_data_ready(s->ctrl);
+	if (ready > j)
+		ready = j;
+	ready -= ready % frame_size;
+	if (!ready)
+		return;
+
+	qubes_jack_chan_read(s->ctrl, scratch, ready);
+	if (capturing(s))
+		qubes_jack_capture(QUBES_JACK_CAP_DISCARD, s->capture_id,
+				   scratch, ready);
+	s->stats.discarded_frames += ready / frame_size;
+	qubes_jack_trace_instant("discard", s->name, ready / frame_size);
+}
+
+/*
+ * Each transfer costs at most one event channel notification to the peer,
+ * so periods that didn't need their own transfer are notifications saved.
+ */
+static uint64_t notifications_saved_per_sec(const struct qubes_jack_stream *s)
+{
+	uint64_t elapsed_ms = (now_ns() - s->start_ns) / 1000000;
+	uint64_t saved = s->stats.periods > s->stats.transfers ?
+		s->stats.periods - s->stats.transfers : 0;
+
+	if (!elapsed_ms)
+		return 0;
+	return saved * 1000 / elapsed_ms;
+}
+
+void qubes_jack_stream_print_stats(const struct qubes_jack_stream *s, FILE *f)
+{
+	fprintf(f, "%s (%s): periods %" PRIu64 ", overflow %" PRIu64
+		" frames, underflow %" PRIu64 " frames, discarded %" PRIu64
+		" frames, latency excursions %" PRIu64 ", block timeouts %"
+		PRIu64 ", max backlog %" PRIu32 " frames, batch %u, transfers %"
+		PRIu64 ", concealed %" PRIu64 " frames, notifications saved %"
+		PRIu64 "/s\n",
+		s->name, policy_names[s->policy], s->stats.periods,
+		s->stats.overflow_frames, s->stats.underflow_frames,
+		s->stats.discarded_frames, s->stats.latency_excursions,
+		s->stats.block_timeouts, s->stats.max_backlog, s->batch,
+		s->stats.transfers, s->stats.concealed_frames,
+		notifications_saved_per_sec(s));
+}
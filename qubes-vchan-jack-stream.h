@@ -0,0 +1,127 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_VCHAN_JACK_STREAM_H
+#define QUBES_VCHAN_JACK_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "qubes-vchan-jack-transport.h"
+
+// What to do when the ring is full (sender) or short (receiver)
+enum qubes_jack_policy {
+	// Skip the period that doesn't fit; for a short one play what has
+	// arrived and conceal the rest
+	QUBES_JACK_POLICY_DROP_NEWEST,
+	// Like drop-newest, but the receiver also trims queued frames
+	// beyond max_latency so latency stays bounded
+	QUBES_JACK_POLICY_DROP_OLDEST,
+	// Wait up to timeout_ms for space/data, then drop-newest
+	QUBES_JACK_POLICY_BLOCK,
+};
+
+// A cancellable wait looks at its flag at least this often
+#define QUBES_JACK_CANCEL_POLL_MS 10
+
+struct qubes_jack_stream_stats {
+	uint64_t periods;
+	uint64_t overflow_frames;	// sender: frames dropped, ring full
+	uint64_t underflow_frames;	// receiver: frames missing at period end
+	uint64_t discarded_frames;	// receiver: queued frames trimmed or skipped
+	uint64_t latency_excursions;	// receiver: backlog went over bound
+	uint64_t block_timeouts;
+	uint32_t max_backlog;		// receiver: frames queued, high water
+	uint64_t transfers;		// vchan reads/writes actually issued
+	uint64_t concealed_frames;	// receiver: missing frames synthesized
+};
+
+// Frames of recent audio repeated to conceal an underrun
+#define QUBES_JACK_CONCEAL_FRAMES 64
+// Concealment fades to silence over this many frames
+#define QUBES_JACK_CONCEAL_FADE 512
+// Real audio is crossfaded back in over this many frames
+#define QUBES_JACK_CONCEAL_RAMP 32
+
+struct qubes_jack_stream {
+	const char *name;
+	struct qubes_jack_chan *ctrl;
+	enum qubes_jack_policy policy;
+	int timeout_ms;			// 0: four periods
+	unsigned int max_latency;	// frames queued beyond a period, 0: batch + 1 periods
+	unsigned int sample_rate;
+	volatile bool lossless;		// wait forever, never drop (freewheel)
+	volatile bool keep_backlog;	// never trim, but never wait either
+	const volatile bool *cancel;	// when set, stop waiting at once
+	bool in_excursion;
+	uint64_t first_data_ns;		// first audio since reset
+	uint64_t start_ns;
+
+	uint32_t max_frames;		// longest period the buffers hold
+
+	// Throughput profile: move batch periods per vchan transfer
+	unsigned int batch;
+	char *batch_buf;
+	long batch_fill;		// sender: bytes staged
+	long batch_pos;			// receiver: next byte to hand out
+	long batch_pending;		// receiver: bytes left to hand out
+	unsigned int batch_count;	// sender: periods staged
+	bool primed;
+
+	// Receiver: the last real frames per channel, for concealment
+	float conceal_hist[MAX_CH][QUBES_JACK_CONCEAL_FRAMES];
+	unsigned int conceal_len;	// valid frames in conceal_hist
+	unsigned int conceal_run;	// frames concealed since real audio
+
+	int capture_id;			// QUBES_JACK_CAP_STREAM_*, -1: not captured
+	struct qubes_jack_stream_stats stats;
+};
+
+#define QUBES_JACK_MAX_BATCH 8
+
+// Bytes of interleaved audio in a period of this many frames
+#define QUBES_JACK_SCRATCH_BYTES(frames) (sizeof(float) * MAX_CH * (frames))
+// Scratch buffers passed to send/recv must hold
+// QUBES_JACK_SCRATCH_BYTES(max_frames), this always does
+#define QUBES_JACK_SCRATCH_SIZE QUBES_JACK_SCRATCH_BYTES(MAX_JACK_BUFFER)
+
+void qubes_jack_stream_init(struct qubes_jack_stream *s, const char *name);
+void qubes_jack_stream_reset(struct qubes_jack_stream *s, struct qubes_jack_chan *ctrl);
+void qubes_jack_stream_flush(struct qubes_jack_stream *s);
+int qubes_jack_stream_set_batch(struct qubes_jack_stream *s, unsigned int batch);
+int qubes_jack_stream_set_period(struct qubes_jack_stream *s, uint32_t frames);
+void qubes_jack_stream_destroy(struct qubes_jack_stream *s);
+int qubes_jack_parse_policy(struct qubes_jack_stream *s, const char *arg);
+int qubes_jack_vchan_wait_ready(struct qubes_jack_chan *ctrl, long j, int timeout_ms,
+				const volatile bool *cancel,
+				bool for_space);
+void qubes_jack_silence(float **bufs, unsigned int channels, uint32_t nframes);
+void qubes_jack_stream_send(struct qubes_jack_stream *s, float **bufs,
+			    unsigned int channels, uint32_t nframes,
+			    char *scratch);
+void qubes_jack_stream_recv(struct qubes_jack_stream *s, float **bufs,
+			    unsigned int channels, uint32_t nframes,
+			    char *scratch);
+void qubes_jack_stream_skip(struct qubes_jack_stream *s, unsigned int channels,
+			    uint32_t nframes, char *scratch);
+void qubes_jack_stream_print_stats(const struct qubes_jack_stream *s, FILE *f);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "qubes-vchan-jack-trace.h"
+
+#define TRACE_FLUSH_US 20000
+
+struct trace_event {
+	uint64_t seq;			// slot state, see trace_push()
+	uint64_t ts_ns;
+	uint64_t dur_ns;		// 0 for instants
+	const char *name;
+	const char *detail;
+	uint32_t arg;
+	int32_t tid;
+	bool instant;
+};
+
+struct trace {
+	FILE *f;
+	int pid;
+	struct trace_event *ring;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t dropped;
+	int64_t offset_ns;
+	volatile bool running;
+	pthread_t thread;
+};
+
+bool qubes_jack_trace_active;
+static struct trace trace;
+static __thread int32_t trace_tid;
+
+/*
+ * Bounded multi-producer queue: slot i is free for the producer at
+ * position pos when its seq equals pos, and holds an event for the
+ * consumer when it equals pos + 1.
+ */
+static void trace_push(const struct trace_event *e)
+{
+	uint64_t pos = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+	struct trace_event *slot;
+	uint64_t seq;
+
+	for (;;) {
+		slot = &trace.ring[pos & (QUBES_JACK_TRACE_EVENTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&trace.head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			__atomic_add_fetch(&trace.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->ts_ns = e->ts_ns;
+	slot->dur_ns = e->dur_ns;
+	slot->name = e->name;
+	slot->detail = e->detail;
+	slot->arg = e->arg;
+	slot->tid = e->tid;
+	slot->instant = e->instant;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// One system call per thread, on its first event
+static int32_t trace_thread_id(void)
+{
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+	return trace_tid;
+}
+
+void qubes_jack_trace_span(const char *name, const char *detail,
+			   uint64_t start_ns, uint32_t arg)
+{
+	struct trace_event e;
+
+	if (!qubes_jack_trace_active)
+		return;
+	e.ts_ns = start_ns;
+	e.dur_ns = now_ns() - start_ns;
+	e.name = name;
+	e.detail = detail;
+	e.arg = arg;
+	e.tid = trace_thread_id();
+	e.instant = false;
+	trace_push(&e);
+}
+
+void qubes_jack_trace_instant(const char *name, const char *detail,
+			      uint32_t arg)
+{
+	struct trace_event e;
+
+	if (!qubes_jack_trace_active)
+		return;
+	e.ts_ns = now_ns();
+	e.dur_ns = 0;
+	e.name = name;
+	e.detail = detail;
+	e.arg = arg;
+	e.tid = trace_thread_id();
+	e.instant = true;
+	trace_push(&e);
+}
+
+void qubes_jack_trace_clock_offset(int64_t offset_ns)
+{
+	__atomic_store_n(&trace.offset_ns, offset_ns, __ATOMIC_RELAXED);
+}
+
+static void trace_write(const struct trace_event *e)
+{
+	int64_t offset = __atomic_load_n(&trace.offset_ns, __ATOMIC_RELAXED);
+	double ts = (double)((int64_t)e->ts_ns + offset) / 1000.0;
+
+	// The process name record always comes first
+	fprintf(trace.f, ",\n{\"name\":\"%s\",\"cat\":\"qubes-jack\",\"pid\":%d,"
+		"\"tid\":%" PRId32 ",\"ts\":%.3f,", e->name, trace.pid, e->tid, ts);
+	if (e->instant)
+		fprintf(trace.f, "\"ph\":\"i\",\"s\":\"t\",");
+	else
+		fprintf(trace.f, "\"ph\":\"X\",\"dur\":%.3f,",
+			(double)e->dur_ns / 1000.0);
+	fprintf(trace.f, "\"args\":{");
+	if (e->detail)
+		fprintf(trace.f, "\"detail\":\"%s\",", e->detail);
+	fprintf(trace.f, "\"n\":%" PRIu32 "}}", e->arg);
+}
+
+static void trace_drain(void)
+{
+	struct trace_event *slot;
+	uint64_t pos;
+
+	for (;;) {
+		pos = trace.tail;
+		slot = &trace.ring[pos & (QUBES_JACK_TRACE_EVENTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		trace_write(slot);
+		__atomic_store_n(&slot->seq, pos + QUBES_JACK_TRACE_EVENTS,
+				 __ATOMIC_RELEASE);
+		trace.tail = pos + 1;
+	}
+	fflush(trace.f);
+}
+
+static void *trace_writer(void *arg)
+{
+	(void)arg;
+	while (trace.running) {
+		trace_drain();
+		usleep(TRACE_FLUSH_US);
+	}
+	return NULL;
+}
+
+int qubes_jack_trace_open(const char *path, int pid, const char *process_name)
+{
+	unsigned int i;
+
+	trace.ring = calloc(QUBES_JACK_TRACE_EVENTS, sizeof(*trace.ring));
+	if (!trace.ring) {
+		fprintf(stderr, "Could not allocate trace ring\n");
+		return -1;
+	}
+	for (i = 0; i < QUBES_JACK_TRACE_EVENTS; i++)
+		trace.ring[i].seq = i;
+
+	trace.f = fopen(path, "w");
+	if (!trace.f) {
+		perror(path);
+		free(trace.ring);
+		return -1;
+	}
+	trace.pid = pid;
+	fprintf(trace.f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"%s\"}}", pid, process_name);
+
+	trace.running = true;
+	if (pthread_create(&trace.thread, NULL, trace_writer, NULL)) {
+		fprintf(stderr, "Could not start trace writer\n");
+		fclose(trace.f);
+		free(trace.ring);
+		return -1;
+	}
+	qubes_jack_trace_active = true;
+	return 0;
+}
+
+void qubes_jack_trace_close(void)
+{
+	if (!qubes_jack_trace_active)
+		return;
+
+	qubes_jack_trace_active = false;
+	trace.running = false;
+	pthread_join(trace.thread, NULL);
+	trace_drain();
+
+	fprintf(trace.f, "\n]}\n");
+	fclose(trace.f);
+	if (trace.dropped)
+		fprintf(stderr, "Trace dropped %" PRIu64 " events\n",
+			trace.dropped);
+	free(trace.ring);
+}
@@ -0,0 +1,74 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#ifndef QUBES_VCHAN_JACK_TRACE_H
+#define QUBES_VCHAN_JACK_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "qubes-vchan-jack.h"
+
+/*
+ * Per-cycle event trace in Chrome JSON trace format, readable by
+ * chrome://tracing and the Perfetto UI.  Events go into a preallocated
+ * ring that any thread, including the RT thread, can add to without
+ * locks or system calls; a background thread writes them out.  When the
+ * ring is full events are counted and dropped.
+ *
+ * Names and details must be string literals or otherwise outlive the
+ * trace, only the pointers are queued.
+ */
+#define QUBES_JACK_TRACE_EVENTS (1 << 16)
+
+// Trace process ids, so both sides' traces can be merged
+#define QUBES_JACK_TRACE_PID_SERVER 1
+#define QUBES_JACK_TRACE_PID_CLIENT 2
+
+extern bool qubes_jack_trace_active;
+
+int qubes_jack_trace_open(const char *path, int pid, const char *process_name);
+void qubes_jack_trace_close(void);
+
+// Shift timestamps onto the peer's clock, peer minus ours
+void qubes_jack_trace_clock_offset(int64_t offset_ns);
+
+void qubes_jack_trace_span(const char *name, const char *detail,
+			   uint64_t start_ns, uint32_t arg);
+void qubes_jack_trace_instant(const char *name, const char *detail,
+			      uint32_t arg);
+
+// Start of a span, 0 when not tracing
+static inline uint64_t qubes_jack_trace_begin(void)
+{
+	return qubes_jack_trace_active ? now_ns() : 0;
+}
+
+static inline void qubes_jack_trace_end(uint64_t start_ns, const char *name,
+					const char *detail, uint32_t arg)
+{
+	if (start_ns)
+		qubes_jack_trace_span(name, detail, start_ns, arg);
+}
+
+#endif
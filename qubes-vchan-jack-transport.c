@@ -0,0 +1,137 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <libvchan.h>
+
+#include "qubes-vchan-jack-transport.h"
+
+// libvchan, between domains
+struct vchan_chan {
+	struct qubes_jack_chan base;
+	libvchan_t *v;
+};
+
+static struct qubes_jack_chan *vchan_wrap(libvchan_t *v)
+{
+	struct vchan_chan *c;
+
+	if (!v)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		libvchan_close(v);
+		return NULL;
+	}
+	c->base.t = &qubes_jack_transport_vchan;
+	c->v = v;
+	return &c->base;
+}
+
+static libvchan_t *vchan_of(struct qubes_jack_chan *c)
+{
+	return ((struct vchan_chan *)c)->v;
+}
+
+static struct qubes_jack_chan *vchan_server_init(int domain, int port,
+						 size_t read_min,
+						 size_t write_min)
+{
+	return vchan_wrap(libvchan_server_init(domain, port, read_min, write_min));
+}
+
+static struct qubes_jack_chan *vchan_client_init(int domain, int port)
+{
+	return vchan_wrap(libvchan_client_init(domain, port));
+}
+
+static int vchan_data_ready(struct qubes_jack_chan *c)
+{
+	return libvchan_data_ready(vchan_of(c));
+}
+
+static int vchan_buffer_space(struct qubes_jack_chan *c)
+{
+	return libvchan_buffer_space(vchan_of(c));
+}
+
+static int vchan_read(struct qubes_jack_chan *c, void *data, size_t size)
+{
+	return libvchan_read(vchan_of(c), data, size);
+}
+
+static int vchan_write(struct qubes_jack_chan *c, const void *data, size_t size)
+{
+	return libvchan_write(vchan_of(c), data, size);
+}
+
+static int vchan_fd_for_select(struct qubes_jack_chan *c)
+{
+	return libvchan_fd_for_select(vchan_of(c));
+}
+
+static int vchan_wait(struct qubes_jack_chan *c)
+{
+	return libvchan_wait(vchan_of(c));
+}
+
+static int vchan_is_open(struct qubes_jack_chan *c)
+{
+	return libvchan_is_open(vchan_of(c));
+}
+
+static void vchan_close(struct qubes_jack_chan *c)
+{
+	libvchan_close(vchan_of(c));
+	free(c);
+}
+
+const struct qubes_jack_transport qubes_jack_transport_vchan = {
+	.name = "vchan",
+	.server_init = vchan_server_init,
+	.client_init = vchan_client_init,
+	.data_ready = vchan_data_ready,
+	.buffer_space = vchan_buffer_space,
+	.read = vchan_read,
+	.write = vchan_write,
+	.fd_for_select = vchan_fd_for_select,
+	.wait = vchan_wait,
+	.is_open = vchan_is_open,
+	.close = vchan_close,
+};
+
+static const struct qubes_jack_transport *transports[] = {
+	&qubes_jack_transport_vchan,
+	&qubes_jack_transport_memfd,
+};
+
+const struct qubes_jack_transport *qubes_jack_transport_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+		if (!strcmp(transports[i]->name, name))
+			return transports[i];
+	return NULL;
+}
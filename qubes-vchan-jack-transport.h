@@ -0,0 +1,119 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2017  Damien Zammit <damien@zamaudio.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+
+#ifndef QUBES_VCHAN_JACK_TRANSPORT_H
+#define QUBES_VCHAN_JACK_TRANSPORT_H
+
+#include <stddef.h>
+
+/*
+ * A byte channel between the SoundVM and an AppVM, modelled on libvchan:
+ * each end has a read ring and a write ring, writes and reads never block,
+ * and fd_for_select() becomes readable when the peer has written or read.
+ * is_open() returns 1 when connected, 2 while a server waits for its
+ * client and 0 once either side is gone.
+ */
+struct qubes_jack_chan;
+
+struct qubes_jack_transport {
+	const char *name;
+	struct qubes_jack_chan *(*server_init)(int domain, int port,
+					       size_t read_min, size_t write_min);
+	struct qubes_jack_chan *(*client_init)(int domain, int port);
+	int (*data_ready)(struct qubes_jack_chan *c);
+	int (*buffer_space)(struct qubes_jack_chan *c);
+	int (*read)(struct qubes_jack_chan *c, void *data, size_t size);
+	int (*write)(struct qubes_jack_chan *c, const void *data, size_t size);
+	int (*fd_for_select)(struct qubes_jack_chan *c);
+	int (*wait)(struct qubes_jack_chan *c);	// clear the fd's event
+	int (*is_open)(struct qubes_jack_chan *c);
+	void (*close)(struct qubes_jack_chan *c);
+};
+
+// Every backend's channel starts with this
+struct qubes_jack_chan {
+	const struct qubes_jack_transport *t;
+};
+
+extern const struct qubes_jack_transport qubes_jack_transport_vchan;
+extern const struct qubes_jack_transport qubes_jack_transport_memfd;
+
+const struct qubes_jack_transport *qubes_jack_transport_find(const char *name);
+
+static inline struct qubes_jack_chan *qubes_jack_chan_server_init(
+	const struct qubes_jack_transport *t, int domain, int port,
+	size_t read_min, size_t write_min)
+{
+	return t->server_init(domain, port, read_min, write_min);
+}
+
+static inline struct qubes_jack_chan *qubes_jack_chan_client_init(
+	const struct qubes_jack_transport *t, int domain, int port)
+{
+	return t->client_init(domain, port);
+}
+
+static inline int qubes_jack_chan_data_ready(struct qubes_jack_chan *c)
+{
+	return c->t->data_ready(c);
+}
+
+static inline int qubes_jack_chan_buffer_space(struct qubes_jack_chan *c)
+{
+	return c->t->buffer_space(c);
+}
+
+static inline int qubes_jack_chan_read(struct qubes_jack_chan *c, void *data,
+				       size_t size)
+{
+	return c->t->read(c, data, size);
+}
+
+static inline int qubes_jack_chan_write(struct qubes_jack_chan *c,
+					const void *data, size_t size)
+{
+	return c->t->write(c, data, size);
+}
+
+static inline int qubes_jack_chan_fd_for_select(struct qubes_jack_chan *c)
+{
+	return c->t->fd_for_select(c);
+}
+
+static inline int qubes_jack_chan_wait(struct qubes_jack_chan *c)
+{
+	return c->t->wait(c);
+}
+
+static inline int qubes_jack_chan_is_open(struct qubes_jack_chan *c)
+{
+	return c->t->is_open(c);
+}
+
+static inline void qubes_jack_chan_close(struct qubes_jack_chan *c)
+{
+	if (c)
+		c->t->close(c);
+}
+
+#endif
@@ -19,6 +19,12 @@
  *
  */
 
+#ifndef QUBES_VCHAN_JACK_H
+#define QUBES_VCHAN_JACK_H
+
+#include <stdint.h>
+#include <time.h>
+
 #define QUBES_JACK_CONFIG_VCHAN_PORT 4715
 #define QUBES_JACK_PLAYBACK_VCHAN_PORT 4716
 #define QUBES_JACK_RECORD_VCHAN_PORT 4717
@@ -37,9 +43,98 @@
 #define QUBES_JACK_CONFIG_QUERY_END 0xFE
 // End packet
 
+/*
+ * Control protocol v2
+ *
+ * Every message is a TLV: uint8_t type, uint8_t flags (0), uint16_t length,
+ * then length bytes of big-endian value.  A v2 client opens with a HELLO
+ * message; a v1 server ignores it, so after QUBES_JACK_HELLO_TIMEOUT_MS the
+ * client falls back to sending QUBES_JACK_CONFIG_QUERY_CMD.  A v2 server
+ * answers QUBES_JACK_CONFIG_QUERY_CMD with the v1 packet and never pushes
+ * TLVs to such a client.  TLV types never collide with the v1 bytes.
+ */
+#define QUBES_JACK_CONTROL_VERSION 2
+#define QUBES_JACK_CONTROL_RING_SIZE 4096
+#define QUBES_JACK_HELLO_TIMEOUT_MS 500
+#define QUBES_JACK_HEARTBEAT_MS 1000
+// How long the server holds a direction for the client to echo PORTS
+#define QUBES_JACK_PORTS_ACK_MS 1000
+#define QUBES_JACK_TLV_HEADER_SIZE 4
+#define QUBES_JACK_TLV_MAX_VALUE 1024
+
+// uint32_t version, uint32_t directions: the client's wanted, the server's
+// set up.  Peers that only send the version are duplex.
+#define QUBES_JACK_TLV_HELLO 0x01
+// uint8_t play_count, uint8_t record_count, uint8_t log2 buffer size,
+// uint8_t 0, uint32_t sample_rate, uint32_t xruns
+#define QUBES_JACK_TLV_CONFIG 0x02
+// uint32_t buffer_size (frames), the sender's JACK period, either direction
+#define QUBES_JACK_TLV_BUFFER_SIZE 0x03
+// uint32_t sample_rate
+#define QUBES_JACK_TLV_SAMPLE_RATE 0x04
+// uint8_t play_count, uint8_t record_count, uint16_t 0.  The server sends
+// its counts, the client echoes them once its ports and rings match.
+#define QUBES_JACK_TLV_PORTS 0x05
+// uint32_t sequence
+#define QUBES_JACK_TLV_HEARTBEAT 0x06
+// uint32_t sequence, uint64_t sender timestamp (ns)
+#define QUBES_JACK_TLV_PING 0x07
+// uint32_t sequence, uint64_t echoed sender timestamp, uint64_t responder timestamp
+#define QUBES_JACK_TLV_PONG 0x08
+// repeated { uint32_t key, uint64_t value }
+#define QUBES_JACK_TLV_STATS 0x09
+// uint32_t periods per transfer (throughput profile), server to client
+#define QUBES_JACK_TLV_BATCH 0x0a
+// uint8_t direction (0 playback, 1 record), uint8_t channels, uint16_t 0,
+// repeated { float peak, float rms } per channel, linear full scale 1.0
+#define QUBES_JACK_TLV_METER 0x0b
+// uint8_t direction (0 playback, 1 record), uint8_t 0, uint16_t 0, then a
+// route spec in ASCII, client to server, only honoured by a server run
+// with -R
+#define QUBES_JACK_TLV_ROUTE 0x0c
+// uint32_t 1 when the client's jackd starts freewheeling, 0 when it stops,
+// client to server
+#define QUBES_JACK_TLV_FREEWHEEL 0x0d
+// uint32_t 1, client to server after the HELLO when the client clocks its
+// jackd from record periods (-c), so record stays unbatched
+#define QUBES_JACK_TLV_CLOCKED 0x0e
+
+// Directions, as HELLO bits.  The server always listens on all three vchans
+// and closes the one a client doesn't want once it has said so.
+#define QUBES_JACK_DIR_PLAY 0x1
+#define QUBES_JACK_DIR_REC 0x2
+#define QUBES_JACK_DIR_DUPLEX (QUBES_JACK_DIR_PLAY | QUBES_JACK_DIR_REC)
+
+// Stats keys: a direction base plus a field index
+#define QUBES_JACK_STAT_XRUNS 0x001
+#define QUBES_JACK_STAT_RECONNECTS 0x002
+#define QUBES_JACK_STAT_TTFA_US 0x003
+#define QUBES_JACK_STAT_CB_P99_US 0x004
+#define QUBES_JACK_STAT_CB_MAX_US 0x005
+#define QUBES_JACK_STAT_QOS_CLASS 0x006
+#define QUBES_JACK_STAT_QOS_SHED 0x007
+#define QUBES_JACK_STAT_QOS_MISSES 0x008
+#define QUBES_JACK_STAT_PLAY_BASE 0x100
+#define QUBES_JACK_STAT_REC_BASE 0x200
+#define QUBES_JACK_STAT_PERIODS 0
+#define QUBES_JACK_STAT_OVERFLOW 1
+#define QUBES_JACK_STAT_UNDERFLOW 2
+#define QUBES_JACK_STAT_DISCARDED 3
+#define QUBES_JACK_STAT_EXCURSIONS 4
+#define QUBES_JACK_STAT_TIMEOUTS 5
+#define QUBES_JACK_STAT_MAX_BACKLOG 6
+#define QUBES_JACK_STAT_TRANSFERS 7
+#define QUBES_JACK_STAT_CONCEALED 8
+
 #define MAX_CH 8
 #define MAX_JACK_BUFFER 8192
 
+// Data rings hold this many frames of MAX_CH audio per batched period,
+// doubled until four of the longer of the two JACK periods fit
+#define QUBES_JACK_RING_FRAMES 1024
+// libvchan rings top out at 1 MiB
+#define QUBES_JACK_MAX_RING_FRAMES ((1 << 20) / (MAX_CH * sizeof(float)))
+
 static int __attribute__((unused)) read_nth_u32(void *buf, long n)
 {
 	uint8_t *base = (uint8_t *)buf;
@@ -108,3 +203,26 @@ static uint8_t __attribute__((unused)) log2_(uint32_t value)
 
 	return power;
 }
+
+static uint64_t __attribute__((unused)) now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t __attribute__((unused)) read_nth_u64(void *buf, long n)
+{
+	return ((uint64_t)(uint32_t)read_nth_u32(buf, n) << 32) |
+		(uint32_t)read_nth_u32(buf, n + 1);
+}
+
+// u64 values take two u32 slots, most significant first
+static void __attribute__((unused)) write_nth_u64(void *buf, long n, uint64_t value)
+{
+	write_nth_u32(buf, n, value >> 32);
+	write_nth_u32(buf, n + 1, value & 0xffffffff);
+}
+
+#endif